@@ -3,16 +3,21 @@
 #include "system.h"
 #include "comms.h"
 #include "pico_link.h"
+#include "stats.h"
 
 #include "comms.pio.h"
 
 #include "pico/stdlib.h"
+#include "hardware/dma.h"
 #include "hardware/pio.h"
 
 static PIO comms_pio = pio1;
 
-FIFO<64> comms_out_fifo;
-FIFO<64> comms_in_fifo;
+FIFO<COMMS_OUT_FIFO_SIZE> comms_out_fifo;
+FIFO<COMMS_IN_FIFO_SIZE> comms_in_fifo;
+FIFO<COMMS_STAGING_SIZE> comms_staging;
+absolute_time_t comms_stalled_since;
+uint32_t comms_credit; // staging space freed since the host was last told
 uint32_t comms_out_deferred_req;
 uint32_t comms_out_deferred_ack;
 uint32_t comms_in_empty_req;
@@ -29,18 +34,54 @@ struct CommsRegisters
     uint32_t in_seq;
     uint32_t out_seq;
 
-    uint8_t reserved[256 - (6 * 4)];
+    // block mode only, running byte counts
+    uint32_t block;
+    uint32_t out_consumed;
+    uint32_t in_head;
+
+    uint8_t reserved[256 - (9 * 4)];
 
     uint8_t out_area[256];
 };
 
 static_assert(sizeof(CommsRegisters) == 512);
 
+// Block mode follows the registers with an area the target reads to report how
+// far through in_ring it has got and the ring itself. Neither side waits on the
+// other per byte: the target writes to out_area while it is less than
+// COMMS_BLOCK_RING bytes ahead of out_consumed and reads in_ring up to in_head.
+struct CommsBlockRegisters
+{
+    CommsRegisters regs;
+    uint8_t in_ack_area[256]; // read in_ack_area[tail % 256] once up to tail has been read
+    uint8_t in_ring[256]; // holds at most 255 unread bytes, the acks are only 8-bit
+};
+
+static_assert(sizeof(CommsBlockRegisters) == 1024);
+
 static CommsRegisters *comms_reg = (CommsRegisters *)0x0;
 static uint32_t comms_reg_addr = 0;
+static bool comms_block = false;
+
+// Target writes are collected by dma in block mode, not the irq handlers
+static constexpr uint32_t COMMS_BLOCK_RING = 256;
+static constexpr uint32_t COMMS_BLOCK_TRANSFERS = 0xffffffff;
+static uint8_t __attribute__((aligned(COMMS_BLOCK_RING))) comms_block_out[COMMS_BLOCK_RING];
+static volatile uint8_t comms_block_ack;
+static uint32_t comms_block_consumed;
+static uint32_t comms_block_in_head;
+static uint32_t comms_block_in_tail;
+static int comms_out_chan = -1;
+static int comms_ack_chan = -1;
+
+static uint offset_write = 0;
+static uint offset_read = 0;
 
 void comms_out_irq_handler()
 {
+    // Shared with the address triggers
+    if (pio_sm_is_rx_fifo_empty(pio1, 0)) return;
+
     uint8_t byte = pio_sm_get(pio1, 0) & 0xff; // this must be valid at this point
     if (comms_reg)
     {
@@ -48,6 +89,7 @@ void comms_out_irq_handler()
         if (comms_out_fifo.is_full())
         {
             comms_out_deferred_req++;
+            stats.comms_out_stalls++;
         }
         else
         {
@@ -76,32 +118,68 @@ void comms_in_irq_handler()
     }
 }
 
-static void comms_start_programs(uint32_t addr, uint32_t byte_offset)
+static void comms_sm_set_y(uint sm, uint32_t y)
 {
-    pio_clear_instruction_memory(comms_pio);
+    pio_sm_put(comms_pio, sm, y);
+    pio_sm_exec(comms_pio, sm, pio_encode_pull(false, false));
+    pio_sm_exec(comms_pio, sm, pio_encode_mov(pio_y, pio_osr));
+}
 
-    uint32_t offset_write = pio_add_program(comms_pio, &detect_write_program);
-    uint32_t offset_read = pio_add_program(comms_pio, &detect_read_program);
+static void comms_start_dma(int chan, uint sm, volatile void *dest, bool ring)
+{
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, ring);
+    if (ring) channel_config_set_ring(&c, true, __builtin_ctz(COMMS_BLOCK_RING));
+    channel_config_set_dreq(&c, pio_get_dreq(comms_pio, sm, false));
+    dma_channel_configure(chan, &c, (void *)dest, &comms_pio->rxf[sm], COMMS_BLOCK_TRANSFERS, true);
+}
 
+static void comms_start_programs(uint32_t addr, uint32_t byte_offset)
+{
     pio_sm_config c_write = detect_write_program_get_default_config(offset_write);
     sm_config_set_in_pins(&c_write, 0);
     pio_sm_init(comms_pio, 0, offset_write, &c_write);
+    comms_sm_set_y(0, (addr + 0x100) >> 8);
+
+    if (comms_block)
+    {
+        comms_start_dma(comms_out_chan, 0, comms_block_out, true);
+        pio_sm_set_enabled(comms_pio, 0, true);
+
+        // The acks are an 8-bit index into a window, just like target writes
+        pio_sm_init(comms_pio, 1, offset_write, &c_write);
+        comms_sm_set_y(1, (addr + offsetof(CommsBlockRegisters, in_ack_area)) >> 8);
+        comms_start_dma(comms_ack_chan, 1, &comms_block_ack, false);
+        pio_sm_set_enabled(comms_pio, 1, true);
+        return;
+    }
+
     pio_sm_set_enabled(comms_pio, 0, true);
-    pio_sm_put_blocking(comms_pio, 0, (addr + 0x100) >> 8);
     pio_set_irq0_source_enabled(comms_pio, pis_sm0_rx_fifo_not_empty, true);
 
     pio_sm_config c_read = detect_read_program_get_default_config(offset_read);
     sm_config_set_in_pins(&c_read, 0);
     pio_sm_init(comms_pio, 1, offset_read, &c_read);
+    comms_sm_set_y(1, addr + byte_offset);
     pio_sm_set_enabled(comms_pio, 1, true);
-    pio_sm_put_blocking(comms_pio, 1, addr + byte_offset);
     pio_set_irq1_source_enabled(comms_pio, pis_sm1_rx_fifo_not_empty, true);
 }
 
 static void comms_end_programs()
 {
+    pio_set_irq0_source_enabled(comms_pio, pis_sm0_rx_fifo_not_empty, false);
+    pio_set_irq1_source_enabled(comms_pio, pis_sm1_rx_fifo_not_empty, false);
+
     pio_sm_set_enabled(comms_pio, 0, false);
     pio_sm_set_enabled(comms_pio, 1, false);
+
+    if (comms_block)
+    {
+        dma_channel_abort(comms_out_chan);
+        dma_channel_abort(comms_ack_chan);
+    }
 }
 
 static void update_comms_out(uint8_t *outbytes, int *outcount, int max_outcount)
@@ -119,37 +197,57 @@ static void update_comms_out(uint8_t *outbytes, int *outcount, int max_outcount)
 
         if (*outcount == max_outcount)
         {
-            pl_send_payload(PacketType::CommsData, outbytes, *outcount);
+            pl_queue_payload(PacketType::CommsData, outbytes, *outcount);
             *outcount = 0;
         }
     }
+
+    pl_flush_queued();
+}
+
+void comms_load_programs()
+{
+    offset_write = pio_add_program(comms_pio, &detect_write_program);
+    offset_read = pio_add_program(comms_pio, &detect_read_program);
 }
 
 void comms_init()
 {
-    irq_set_exclusive_handler(PIO1_IRQ_0, comms_out_irq_handler);
+    comms_load_programs();
+
+    comms_out_chan = dma_claim_unused_channel(true);
+    comms_ack_chan = dma_claim_unused_channel(true);
+
+    irq_add_shared_handler(PIO1_IRQ_0, comms_out_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
     irq_set_exclusive_handler(PIO1_IRQ_1, comms_in_irq_handler);
+    irq_set_enabled(PIO1_IRQ_0, true);
 }
 
-void comms_begin_session(uint32_t addr, uint8_t *rom_base)
+void comms_begin_session(uint32_t addr, uint8_t *rom_base, bool block)
 {
     uint32_t ints = save_and_disable_interrupts();
     comms_out_fifo.clear();
     comms_in_fifo.clear();
+    comms_staging.clear();
+    comms_credit = COMMS_STAGING_SIZE;
     comms_out_deferred_ack = 0;
     comms_out_deferred_req = 0;
     comms_in_empty_ack = 0;
     comms_in_empty_req = 1;
-    comms_reg_addr = addr & ADDR_MASK & ~0x1ff;
+    comms_block = block;
+    comms_block_ack = 0;
+    comms_block_consumed = comms_block_in_head = comms_block_in_tail = 0;
+    uint32_t size = block ? sizeof(CommsBlockRegisters) : sizeof(CommsRegisters);
+    comms_reg_addr = addr & ADDR_MASK & ~(size - 1);
     comms_reg = (CommsRegisters *)(rom_base + comms_reg_addr);
-    memset(comms_reg, 0, sizeof(CommsRegisters));
+    memset(comms_reg, 0, size);
     memcpy(comms_reg->magic, "PICO", 4);
+    comms_reg->block = block;
     
     comms_start_programs(comms_reg_addr, offsetof(CommsRegisters, in_byte));
 
     restore_interrupts(ints);
 
-    irq_set_enabled(PIO1_IRQ_0, true);
     irq_set_enabled(PIO1_IRQ_1, true);
 
     comms_reg->active = 1;
@@ -159,7 +257,6 @@ void comms_end_session()
 {
     if (comms_reg == nullptr) return;
 
-    irq_set_enabled(PIO1_IRQ_0, false);
     irq_set_enabled(PIO1_IRQ_1, false);
 
     comms_reg->active = 0;
@@ -168,32 +265,54 @@ void comms_end_session()
     comms_end_programs();
 }
 
-bool comms_update(const uint8_t *data, uint32_t len, uint32_t timeout_ms)
+static void update_comms_block_out()
 {
-    if (comms_reg == nullptr) return true;
+    uint32_t written = COMMS_BLOCK_TRANSFERS - dma_hw->ch[comms_out_chan].transfer_count;
 
-    absolute_time_t end_time = make_timeout_time_ms(timeout_ms);
+    while (comms_block_consumed != written)
+    {
+        uint8_t outbytes[MAX_PKT_PAYLOAD];
+        uint32_t count = MIN(written - comms_block_consumed, sizeof(outbytes));
+        for (uint32_t i = 0; i < count; i++)
+        {
+            outbytes[i] = comms_block_out[(comms_block_consumed + i) % COMMS_BLOCK_RING];
+        }
+        pl_queue_payload(PacketType::CommsData, outbytes, count);
+        comms_block_consumed += count;
+        stats.comms_out_bytes += count;
+    }
 
-    uint8_t outbytes[MAX_PKT_PAYLOAD];
-    int outcount = 0;
+    comms_reg->out_consumed = comms_block_consumed;
 
-    update_comms_out(outbytes, &outcount, sizeof(outbytes));
-    
-    uint incount = 0;
-    while (incount < len)
+    pl_flush_queued();
+}
+
+static void update_comms_block_in()
+{
+    CommsBlockRegisters *block = (CommsBlockRegisters *)comms_reg;
+
+    comms_block_in_tail += (uint8_t)(comms_block_ack - comms_block_in_tail);
+
+    uint32_t space = sizeof(block->in_ring) - 1 - (comms_block_in_head - comms_block_in_tail);
+    uint32_t count = MIN(space, comms_staging.count());
+    if (count == 0) return;
+
+    for (uint32_t i = 0; i < count; i++)
     {
-        comms_reg->pending = 1;
-        do
-        {
-            update_comms_out(outbytes, &outcount, sizeof(outbytes));
-            if (absolute_time_diff_us(get_absolute_time(), end_time) < 0)
-            {
-                return false;
-            }
-        } while (comms_in_fifo.is_full());
+        block->in_ring[(comms_block_in_head + i) % sizeof(block->in_ring)] = comms_staging.pop();
+    }
 
-        comms_in_fifo.push(data[incount]);
-        incount++;
+    __dmb();
+    comms_block_in_head += count;
+    comms_reg->in_head = comms_block_in_head;
+}
+
+static void update_comms_in()
+{
+    while (!comms_staging.is_empty() && !comms_in_fifo.is_full())
+    {
+        comms_reg->pending = 1;
+        comms_in_fifo.push(comms_staging.pop());
 
         if(comms_in_empty_ack != comms_in_empty_req)
         {
@@ -202,12 +321,87 @@ bool comms_update(const uint8_t *data, uint32_t len, uint32_t timeout_ms)
             comms_in_empty_ack++;
         }
     }
-    
-    if (outcount > 0)
+}
+
+bool comms_idle()
+{
+    if (comms_reg == nullptr) return true;
+
+    // Block mode is all dma, it has to be polled
+    if (comms_block) return false;
+
+    return comms_out_fifo.is_empty() && comms_out_deferred_ack == comms_out_deferred_req && comms_staging.is_empty();
+}
+
+bool comms_queue(const uint8_t *data, uint32_t len)
+{
+    if (comms_reg == nullptr) return true;
+
+    // The host has sent more than its credit, the credit for it is returned
+    if (COMMS_STAGING_SIZE - comms_staging.count() < len)
     {
-        pl_send_payload(PacketType::CommsData, outbytes, outcount);
+        comms_credit += len;
+        return false;
     }
 
+    if (comms_staging.is_empty()) comms_stalled_since = get_absolute_time();
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        comms_staging.push(data[i]);
+    }
+    stats.comms_in_bytes += len;
+
     return true;
 }
 
+bool comms_update(uint32_t timeout_ms)
+{
+    if (comms_reg == nullptr) return true;
+
+    uint32_t staged = comms_staging.count();
+
+    if (comms_block)
+    {
+        update_comms_block_out();
+        update_comms_block_in();
+    }
+    else
+    {
+        uint8_t outbytes[MAX_PKT_PAYLOAD];
+        int outcount = 0;
+
+        update_comms_out(outbytes, &outcount, sizeof(outbytes));
+        update_comms_in();
+
+        if (outcount > 0)
+        {
+            pl_queue_payload(PacketType::CommsData, outbytes, outcount);
+            stats.comms_out_bytes += outcount;
+        }
+    }
+
+    bool ok = true;
+    if (staged != 0 && comms_staging.count() != staged)
+    {
+        comms_credit += staged - comms_staging.count();
+        comms_stalled_since = get_absolute_time();
+    }
+    else if (staged != 0 && absolute_time_diff_us(comms_stalled_since, get_absolute_time()) > (int64_t)timeout_ms * 1000)
+    {
+        // The target has stopped reading, drop what it hasn't taken
+        comms_credit += staged;
+        comms_staging.clear();
+        stats.comms_timeouts++;
+        ok = false;
+    }
+
+    // Batched unless the host could be waiting on the last of it
+    if (comms_credit >= MAX_PKT_PAYLOAD || (comms_credit > 0 && comms_staging.is_empty()))
+    {
+        pl_send_payload(PacketType::CommsCredit, &comms_credit, sizeof(comms_credit));
+        comms_credit = 0;
+    }
+
+    return ok;
+}
@@ -6,9 +6,26 @@
 
 #include "hardware/sync.h"
 
+// Both can be set from the build, they must be powers of two
+#if !defined(COMMS_OUT_FIFO_SIZE)
+#define COMMS_OUT_FIFO_SIZE 256
+#endif
+
+#if !defined(COMMS_IN_FIFO_SIZE)
+#define COMMS_IN_FIFO_SIZE 64
+#endif
+
+// Host data waiting for room in the in fifo or ring
+#if !defined(COMMS_STAGING_SIZE)
+#define COMMS_STAGING_SIZE 128
+#endif
+
 template<uint32_t N>
 struct FIFO
 {
+    static_assert((N & (N - 1)) == 0, "FIFO size must be a power of two");
+    static constexpr uint32_t MASK = N - 1;
+
     uint32_t head;
     uint32_t tail;
     uint8_t data[N];
@@ -40,14 +57,14 @@ struct FIFO
 
     void push(uint8_t v)
     {
-        data[head % N] = v;
+        data[head & MASK] = v;
         __dmb();
         head++;
     }
 
     uint8_t pop()
     {
-        uint8_t v = data[tail % N];
+        uint8_t v = data[tail & MASK];
         __dmb();
         tail++;
         return v;
@@ -55,13 +72,30 @@ struct FIFO
 
     uint8_t peek()
     {
-        return data[tail % N];
+        return data[tail & MASK];
     }
 };
 
 void comms_init();
-void comms_begin_session(uint32_t addr, uint8_t *rom_base);
+
+// Load the comms programs into pio1, again after anything else has cleared it
+void comms_load_programs();
+
+// Block mode moves data through rings in the register area instead of a handshake per byte
+void comms_begin_session(uint32_t addr, uint8_t *rom_base, bool block);
 void comms_end_session();
-bool comms_update(const uint8_t *data, uint32_t len, uint32_t timeout_ms);
+
+// Nothing will happen until the next comms interrupt
+bool comms_idle();
+
+// Queue host data for the target, false without taking any if there is no room for all of it.
+// The host is given credit for COMMS_STAGING_SIZE bytes when the session starts and for
+// more as the target takes them, so there is always room unless it sends more than that.
+bool comms_queue(const uint8_t *data, uint32_t len);
+
+// Move queued data on to the target and collect what it has sent, without blocking.
+// Sends CommsCredit for staged data that has been taken or dropped.
+// False if queued data has waited more than timeout_ms for the target, it is dropped.
+bool comms_update(uint32_t timeout_ms);
 
 #endif // COMMS_H
\ No newline at end of file
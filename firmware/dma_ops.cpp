@@ -0,0 +1,71 @@
+#include "hardware/dma.h"
+
+#include "dma_ops.h"
+
+// CALC field values for SNIFF_CTRL
+static constexpr uint DMA_SNIFF_CRC32_REV = 0x1; // CRC32 with bit reversed input
+
+uint32_t dma_crc32(const void *data, uint32_t len)
+{
+    static uint32_t discard;
+
+    uint chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, true);
+
+    // Reflected input plus inverted and reflected output gives the usual CRC32
+    dma_sniffer_enable(chan, DMA_SNIFF_CRC32_REV, true);
+    hw_set_bits(&dma_hw->sniff_ctrl, DMA_SNIFF_CTRL_OUT_REV_BITS | DMA_SNIFF_CTRL_OUT_INV_BITS);
+    dma_hw->sniff_data = 0xffffffff;
+
+    dma_channel_configure(chan, &c, &discard, data, len, true);
+    dma_channel_wait_for_finish_blocking(chan);
+
+    uint32_t crc = dma_hw->sniff_data;
+
+    dma_sniffer_disable();
+    dma_channel_unclaim(chan);
+
+    return crc;
+}
+
+void dma_copy(void *dest, const void *src, uint32_t len)
+{
+    bool aligned = (((uintptr_t)dest | (uintptr_t)src | len) & 3) == 0;
+
+    uint chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+
+    dma_channel_configure(chan, &c, dest, src, aligned ? len / 4 : len, true);
+    dma_channel_wait_for_finish_blocking(chan);
+
+    dma_channel_unclaim(chan);
+}
+
+void dma_fill(void *dest, uint8_t value, uint32_t len)
+{
+    static uint32_t pattern;
+    pattern = value * 0x01010101u;
+
+    bool aligned = (((uintptr_t)dest | len) & 3) == 0;
+
+    uint chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c = dma_channel_get_default_config(chan);
+    channel_config_set_transfer_data_size(&c, aligned ? DMA_SIZE_32 : DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+
+    dma_channel_configure(chan, &c, dest, &pattern, aligned ? len / 4 : len, true);
+    dma_channel_wait_for_finish_blocking(chan);
+
+    dma_channel_unclaim(chan);
+}
@@ -0,0 +1,16 @@
+#if !defined(DMA_OPS_H)
+#define DMA_OPS_H 1
+
+#include <stdint.h>
+
+// Standard (zlib/IEEE 802.3) CRC32 of len bytes at data, calculated by the
+// DMA sniffer so the cpu is free while it runs.
+uint32_t dma_crc32(const void *data, uint32_t len);
+
+// memcpy using DMA, word at a time when everything is word aligned
+void dma_copy(void *dest, const void *src, uint32_t len);
+
+// memset using DMA, word at a time when dest and len are word aligned
+void dma_fill(void *dest, uint8_t value, uint32_t len);
+
+#endif // DMA_OPS_H
@@ -0,0 +1,150 @@
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/pio.h"
+
+#include "system.h"
+#include "latency.h"
+
+#include "latency.pio.h"
+
+static PIO latency_pio = pio1;
+
+// pio1 state machines 0 and 1 belong to comms
+static constexpr uint LATENCY_SM = 2;
+
+// Loops before a probe gives up, two cycles each
+static constexpr uint32_t PROBE_LOOPS = 1000;
+
+static void start_probe(uint offset, uint out_base, uint out_dirs, uint32_t idle, uint jmp_pin)
+{
+    pio_sm_config c = latency_probe_program_get_default_config(offset);
+    sm_config_set_out_pins(&c, out_base, 2);
+    sm_config_set_out_shift(&c, true, false, 32);
+    sm_config_set_jmp_pin(&c, jmp_pin);
+    pio_sm_init(latency_pio, LATENCY_SM, offset, &c);
+
+    pio_sm_set_pins_with_mask(latency_pio, LATENCY_SM, idle << out_base, 3u << out_base);
+    pio_sm_set_consecutive_pindirs(latency_pio, LATENCY_SM, out_base, out_dirs, true);
+    for (uint ofs = 0; ofs < out_dirs; ofs++)
+    {
+        pio_gpio_init(latency_pio, out_base + ofs);
+    }
+
+    // Time the pin itself rather than through the 2 cycle input synchronizer
+    hw_set_bits(&latency_pio->input_sync_bypass, 1u << jmp_pin);
+    gpio_set_input_enabled(jmp_pin, true);
+
+    pio_sm_set_enabled(latency_pio, LATENCY_SM, true);
+}
+
+static void stop_probe(uint out_base, uint out_dirs, uint jmp_pin)
+{
+    pio_sm_set_enabled(latency_pio, LATENCY_SM, false);
+    pio_sm_set_consecutive_pindirs(latency_pio, LATENCY_SM, out_base, out_dirs, false);
+
+    hw_clear_bits(&latency_pio->input_sync_bypass, 1u << jmp_pin);
+    gpio_set_input_enabled(jmp_pin, false);
+}
+
+// Drive idle and let it settle, then drive active and return the number of
+// cycles until the jmp pin went high. UINT32_MAX on timeout.
+static uint32_t probe(uint32_t idle, uint32_t active)
+{
+    pio_sm_put_blocking(latency_pio, LATENCY_SM, 0);
+    pio_sm_put_blocking(latency_pio, LATENCY_SM, idle);
+    pio_sm_get_blocking(latency_pio, LATENCY_SM);
+
+    busy_wait_us_32(2);
+
+    pio_sm_put_blocking(latency_pio, LATENCY_SM, PROBE_LOOPS);
+    pio_sm_put_blocking(latency_pio, LATENCY_SM, active);
+    uint32_t y = pio_sm_get_blocking(latency_pio, LATENCY_SM);
+    if (y > PROBE_LOOPS) return UINT32_MAX;
+
+    // The pins change at the end of the out, the jmp pin is first tested on the next cycle
+    return ((PROBE_LOOPS - y) * 2) + 1;
+}
+
+static void measure(uint32_t samples, uint32_t idle, uint32_t active, LatencyStats *stats)
+{
+    uint32_t total = 0;
+    uint32_t count = 0;
+
+    stats->min = UINT16_MAX;
+    stats->max = 0;
+    stats->timeouts = 0;
+
+    for (uint32_t i = 0; i < samples; i++)
+    {
+        uint32_t cycles = probe(idle, active);
+        if (cycles == UINT32_MAX)
+        {
+            stats->timeouts++;
+            continue;
+        }
+
+        stats->min = MIN(stats->min, cycles);
+        stats->max = MAX(stats->max, cycles);
+        total += cycles;
+        count++;
+    }
+
+    if (count == 0) stats->min = 0;
+    stats->avg = count ? total / count : 0;
+}
+
+void latency_measure(uint8_t *rom, uint32_t samples, LatencyStats *addr, LatencyStats *oe)
+{
+    uint8_t saved[2] = { rom[0], rom[1] };
+
+    // Comms and the triggers reload their programs afterwards
+    pio_clear_instruction_memory(latency_pio);
+    uint offset = pio_add_program(latency_pio, &latency_probe_program);
+
+    // a0 from 0 to 1 with OE and CE held asserted, data 0x00 to 0xff
+    rom[0] = 0x00;
+    rom[1] = 0xff;
+    for (uint ofs = 0; ofs < N_OE_PINS; ofs++)
+    {
+        gpio_set_inover(BASE_OE_PIN + ofs, GPIO_OVERRIDE_LOW);
+    }
+    gpio_set_input_enabled(BASE_ADDR_PIN, true);
+
+    start_probe(offset, BASE_ADDR_PIN, 1, 0, BASE_DATA_PIN);
+    measure(samples, 0, 1, addr);
+    stop_probe(BASE_ADDR_PIN, 1, BASE_DATA_PIN);
+
+    for (uint ofs = 0; ofs < N_OE_PINS; ofs++)
+    {
+        gpio_set_inover(BASE_OE_PIN + ofs, GPIO_OVERRIDE_NORMAL);
+    }
+
+    // OE and CE from deasserted to asserted, at address 0 with no target attached
+#if OUTPUT_BUFFER==1
+    // The data pins are always driven, it is the buffer enable that matters. It is active low.
+    uint oe_probe_pin = BASE_BUF_OE_PIN;
+    gpio_set_inover(oe_probe_pin, GPIO_OVERRIDE_INVERT);
+#else
+    // Pulled down until the data pins are driven
+    uint oe_probe_pin = BASE_DATA_PIN;
+    gpio_set_pulls(oe_probe_pin, false, true);
+#endif
+    rom[0] = 0xff;
+
+    start_probe(offset, BASE_OE_PIN, N_OE_PINS, 3, oe_probe_pin);
+    measure(samples, 3, 0, oe);
+    stop_probe(BASE_OE_PIN, N_OE_PINS, oe_probe_pin);
+
+    gpio_set_inover(oe_probe_pin, GPIO_OVERRIDE_NORMAL);
+
+    // Give the OE pins back to the data state machines
+    for (uint ofs = 0; ofs < N_OE_PINS; ofs++)
+    {
+        pio_gpio_init(pio0, BASE_OE_PIN + ofs);
+    }
+
+    pio_remove_program(latency_pio, &latency_probe_program, offset);
+
+    rom[0] = saved[0];
+    rom[1] = saved[1];
+}
@@ -0,0 +1,22 @@
+#if !defined(LATENCY_H)
+#define LATENCY_H 1
+
+#include <stdint.h>
+
+struct LatencyStats
+{
+    uint16_t min; // sys clock cycles
+    uint16_t avg;
+    uint16_t max;
+    uint16_t timeouts;
+};
+
+// Self test, the PicoROM must not be plugged into a target since it drives
+// address line 0 and the OE/CE inputs itself.
+// addr measures a0 changing to the data pins changing, oe measures OE/CE
+// asserting to the data being driven. rom is the image being served, its
+// first two bytes are borrowed for the duration.
+// configure_address_pins needs to be called afterwards.
+void latency_measure(uint8_t *rom, uint32_t samples, LatencyStats *addr, LatencyStats *oe);
+
+#endif // LATENCY_H
@@ -3,6 +3,8 @@
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/flash.h"
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
 #include "hardware/structs/syscfg.h"
 #include "pico/binary_info.h"
 #include "pico/unique_id.h"
@@ -13,70 +15,360 @@
 #include "pico_link.h"
 #include "rom.h"
 #include "comms.h"
+#include "dma_ops.h"
+#include "latency.h"
+#include "trace.h"
+#include "trigger.h"
+#include "usb_descriptors.h"
+#include "stats.h"
 
 
 static constexpr uint FLASH_ROM_OFFSET = FLASH_SIZE - ROM_SIZE;
 static constexpr uint FLASH_CFG_OFFSET = FLASH_ROM_OFFSET - FLASH_SECTOR_SIZE;
 
-static constexpr uint CONFIG_VERSION = 0x00010007;
+// Slot 0 is the image written by CommitFlash, the rest are stacked below the config sector
+static constexpr uint N_FLASH_SLOTS = 5;
+
+static constexpr uint32_t flash_slot_offset(uint slot)
+{
+    return slot == 0 ? FLASH_ROM_OFFSET : FLASH_CFG_OFFSET - (slot * ROM_SIZE);
+}
+
+static constexpr uint CONFIG_VERSION = 0x00010009;
+static constexpr uint CONFIG_VERSION_NO_CLOCK = 0x00010008;
+static constexpr uint CONFIG_VERSION_NO_SLOTS = 0x00010007;
+
+struct ClockProfile
+{
+    uint32_t khz;
+    vreg_voltage voltage;
+};
+
+// Selected by index, 0 is the default. Every PIO program runs at the full
+// system clock so their timing scales with it, the flash runs at half the
+// system clock so 250MHz is as far as it goes.
+static constexpr ClockProfile clock_profiles[] = {
+    { 160000, VREG_VOLTAGE_DEFAULT }, // standard
+    { 100000, VREG_VOLTAGE_1_00 },    // low power
+    { 200000, VREG_VOLTAGE_1_15 },    // fast
+    { 250000, VREG_VOLTAGE_1_20 },    // fastest
+};
+static constexpr uint N_CLOCK_PROFILES = count_of(clock_profiles);
 
 uint32_t rom_offset = 0;
+
+// Bulk writes can carry a sequence number. Once they have landed they are
+// acknowledged cumulatively, every few writes or whenever the link goes idle.
+static constexpr uint32_t WRITE_ACK_INTERVAL = 4;
+
+static uint32_t write_seq_receiving = 0;
+static uint32_t write_seq_done = 0;
+static uint32_t writes_unacked = 0;
+
+// Where the write being received goes, for reporting it if it fails
+static uint32_t write_offset = 0;
+static uint32_t write_size = 0;
+
+static void report_bulk_write_error(uint32_t seq, uint32_t offset, uint32_t size, const char *msg)
+{
+    if (seq != 0)
+    {
+        uint32_t err[3] = { seq, offset, size };
+        pl_send_payload(PacketType::WriteError, err, sizeof(err));
+    }
+    else
+    {
+        pl_send_error(msg, offset, size);
+    }
+}
+
+// Report a bulk write that doesn't fit and discard its data
+static void reject_bulk_write(uint32_t seq, uint32_t offset, uint32_t size)
+{
+    report_bulk_write_error(seq, offset, size, "Bulk write out of range");
+    pl_begin_bulk(nullptr, size);
+}
+
 const uint8_t *flash_rom_data = (uint8_t *)(XIP_BASE + FLASH_ROM_OFFSET);
 
+extern char __flash_binary_end;
+
+struct SlotInfo
+{
+    uint32_t addr_mask; // 0 when the slot is empty
+    uint32_t crc;
+};
+
 struct Config
 {
     uint32_t version;
     char name[32];
 
     uint32_t addr_mask;
+
+    // Added in 0x00010008
+    uint32_t boot_slot;
+    SlotInfo slots[N_FLASH_SLOTS];
+
+    // Added in 0x00010009
+    uint32_t clock_profile;
 };
 
 Config config;
-const Config *flash_config = (Config *)(XIP_BASE + FLASH_CFG_OFFSET);
-static_assert(sizeof(Config) <= FLASH_PAGE_SIZE);
+Stats stats;
+
+// A record that was only partly programmed, power lost part way through, has
+// a crc that doesn't match
+struct ConfigRecord
+{
+    Config config;
+    uint8_t reserved[FLASH_PAGE_SIZE - sizeof(Config) - sizeof(uint32_t)];
+    uint32_t crc;
+};
+static_assert(sizeof(ConfigRecord) == FLASH_PAGE_SIZE);
 
+// The config sector is a log of page sized records, the last valid one is
+// current. Changes are programmed into the next erased page and the sector is
+// only erased once every page has been used.
+static constexpr uint N_CONFIG_RECORDS = FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE;
 
+// Index of the last programmed record, N_CONFIG_RECORDS when the sector is erased
+static uint config_record = N_CONFIG_RECORDS;
 
-void save_config()
+// Changes are written once they have settled, so a burst of them from a host
+// renaming and remasking costs a single page
+static constexpr uint32_t CONFIG_FLUSH_DELAY_US = 250 * 1000;
+static bool config_dirty = false;
+static uint32_t config_changed_us = 0;
+
+static const ConfigRecord *flash_config_record(uint index)
+{
+    return (const ConfigRecord *)(XIP_BASE + FLASH_CFG_OFFSET + (index * FLASH_PAGE_SIZE));
+}
+
+static bool config_record_valid(uint index)
+{
+    const ConfigRecord *record = flash_config_record(index);
+    return record->crc == dma_crc32(&record->config, sizeof(Config));
+}
+
+static bool config_record_erased(uint index)
 {
-    if( !memcmp(&config, flash_config, sizeof(Config))) return;
+    const uint32_t *words = (const uint32_t *)flash_config_record(index);
+    for (uint i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++)
+    {
+        if (words[i] != 0xffffffff) return false;
+    }
+    return true;
+}
+
 
+
+// Nothing can execute from flash while it is being written. rom_loop runs
+// from ram and never touches XIP so with BACKGROUND_FLASH core1 keeps serving
+// the ROM throughout, otherwise it is stopped.
+static uint32_t flash_write_begin()
+{
+#if BACKGROUND_FLASH==0
     rom_service_stop();
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(FLASH_CFG_OFFSET, FLASH_SECTOR_SIZE);
-    flash_range_program(FLASH_CFG_OFFSET, (uint8_t *)&config, FLASH_PAGE_SIZE);
+#endif
+    return save_and_disable_interrupts();
+}
+
+static void flash_write_end(uint32_t ints)
+{
     restore_interrupts(ints);
-    rom_service_start();
+#if BACKGROUND_FLASH==0
+    rom_service_start(config.addr_mask);
+#endif
+}
+
+// Write the config now if it has changed
+void flush_config()
+{
+    config_dirty = false;
+
+    if (config_record < N_CONFIG_RECORDS && !memcmp(&config, &flash_config_record(config_record)->config, sizeof(Config)) &&
+        config_record_valid(config_record))
+    {
+        return;
+    }
+
+    uint next = config_record + 1;
+    if (config_record == N_CONFIG_RECORDS) next = 0;
+    bool erase = next == N_CONFIG_RECORDS || !config_record_erased(next);
+    if (erase) next = 0;
+
+    ConfigRecord record;
+    memset(&record, 0xff, sizeof(record));
+    record.config = config;
+    record.crc = dma_crc32(&config, sizeof(Config));
+
+    uint32_t ints = flash_write_begin();
+    if (erase) flash_range_erase(FLASH_CFG_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(FLASH_CFG_OFFSET + (next * FLASH_PAGE_SIZE), (uint8_t *)&record, FLASH_PAGE_SIZE);
+    flash_write_end(ints);
+
+    config_record = next;
+}
+
+// Mark the config as changed, it is written by config_update
+void save_config()
+{
+    config_dirty = true;
+    config_changed_us = time_us_32();
+}
+
+void config_update()
+{
+    if (config_dirty && (time_us_32() - config_changed_us) >= CONFIG_FLUSH_DELAY_US) flush_config();
+}
+
+bool config_idle()
+{
+    return !config_dirty;
 }
 
 
 void init_config()
 {
-    memcpy(&config, flash_config, sizeof(Config));
+    // Records are appended in order up to the first erased page. The newest
+    // valid one is current, earlier firmware wrote a single record without a
+    // crc so that is used if there are none.
+    config_record = N_CONFIG_RECORDS;
+    uint current = N_CONFIG_RECORDS;
+    for (uint index = 0; index < N_CONFIG_RECORDS && !config_record_erased(index); index++)
+    {
+        config_record = index;
+        if (config_record_valid(index)) current = index;
+    }
+    if (current == N_CONFIG_RECORDS) current = config_record;
+
+    if (current < N_CONFIG_RECORDS)
+    {
+        memcpy(&config, &flash_config_record(current)->config, sizeof(Config));
+    }
+    else
+    {
+        memset(&config, 0xff, sizeof(Config));
+    }
 
     if (config.version == CONFIG_VERSION) return;
 
-    memset(&config, 0, sizeof(Config));
+    if (config.version == CONFIG_VERSION_NO_SLOTS)
+    {
+        // Keep the name and mask, the committed image becomes slot 0
+        memset(&config.boot_slot, 0, sizeof(Config) - offsetof(Config, boot_slot));
+        config.slots[0].addr_mask = config.addr_mask;
+        config.slots[0].crc = dma_crc32(flash_rom_data, ROM_SIZE);
+    }
+    else if (config.version == CONFIG_VERSION_NO_CLOCK)
+    {
+        memset(&config.clock_profile, 0, sizeof(Config) - offsetof(Config, clock_profile));
+    }
+    else
+    {
+        memset(&config, 0, sizeof(Config));
+
+        config.addr_mask = ADDR_MASK;
+        pico_get_unique_board_id_string(config.name, sizeof(config.name));
+    }
 
-    config.addr_mask = ADDR_MASK;
     config.version = CONFIG_VERSION;
-    pico_get_unique_board_id_string(config.name, sizeof(config.name));
+    flush_config();
+}
 
-    save_config();
+
+static const uint8_t *flash_slot_data(uint slot)
+{
+    return (const uint8_t *)(XIP_BASE + flash_slot_offset(slot));
+}
+
+// Whether the slot exists, the firmware is allowed to grab slots from the top
+// once it grows into them
+static bool slot_available(uint slot)
+{
+    return slot < N_FLASH_SLOTS && flash_slot_data(slot) >= (const uint8_t *)&__flash_binary_end;
+}
+
+
+// Switching images is a single register write, see IMAGE_SELECT_BIT. rom_loop
+// keeps the select bit in its mask so it does not change.
+static constexpr uint IMAGE_SELECT_PIN = BASE_ADDR_PIN + __builtin_ctz(IMAGE_SELECT_BIT);
+
+// Offset of the half being served, 0 or IMAGE_SELECT_BIT
+static uint32_t image_base = 0;
+
+// The trace ring and coverage map have to be outside of the image being served
+static bool trace_fits()
+{
+    return (image_base + config.addr_mask) < TRACE_BUFFER_OFFSET;
 }
 
+static void select_image(uint32_t base)
+{
+    image_base = base;
+    gpio_set_inover(IMAGE_SELECT_PIN, base ? GPIO_OVERRIDE_HIGH : GPIO_OVERRIDE_NORMAL);
+}
 
-void save_rom()
+// Only sectors that differ from flash are erased and programmed. Returns the
+// number written.
+uint32_t save_rom(uint slot)
 {
-    rom_service_stop();
-    uint32_t ints = save_and_disable_interrupts();
-    flash_range_erase(FLASH_ROM_OFFSET, ROM_SIZE);
-    flash_range_program(FLASH_ROM_OFFSET, rom_get_buffer(), ROM_SIZE);
-    restore_interrupts(ints);
-    rom_service_start();
+    const uint8_t *slot_data = flash_slot_data(slot);
+    uint32_t written = 0;
+
+    // Boot always serves the first half, so a swapped in image is copied down
+    // to it. The second half keeps serving, the contents are the same.
+    if (image_base)
+    {
+        dma_copy(rom_get_buffer(), rom_get_buffer() + image_base, IMAGE_SELECT_BIT);
+    }
+
+    for (uint32_t offset = 0; offset < ROM_SIZE; offset += FLASH_SECTOR_SIZE)
+    {
+        const uint8_t *sector = rom_get_buffer() + offset;
+        if (!memcmp(sector, slot_data + offset, FLASH_SECTOR_SIZE)) continue;
+
+        uint32_t ints = flash_write_begin();
+        flash_range_erase(flash_slot_offset(slot) + offset, FLASH_SECTOR_SIZE);
+        flash_range_program(flash_slot_offset(slot) + offset, sector, FLASH_SECTOR_SIZE);
+        flash_write_end(ints);
+
+        written++;
+    }
+
+    config.slots[slot].addr_mask = config.addr_mask;
+    config.slots[slot].crc = dma_crc32(rom_get_buffer(), ROM_SIZE);
+    save_config();
+
+    return written;
 }
 
 
+static vreg_voltage clock_voltage = VREG_VOLTAGE_DEFAULT;
+
+void apply_clock_profile(uint profile)
+{
+    const ClockProfile &p = clock_profiles[profile < N_CLOCK_PROFILES ? profile : 0];
+
+    // The voltage goes up before the clock does and down after it
+    if (p.voltage > clock_voltage)
+    {
+        vreg_set_voltage(p.voltage);
+        busy_wait_us_32(1000);
+    }
+
+    set_sys_clock_khz(p.khz, true);
+
+    if (p.voltage < clock_voltage)
+    {
+        vreg_set_voltage(p.voltage);
+    }
+
+    clock_voltage = p.voltage;
+}
+
 void configure_address_pins(uint32_t mask)
 {
     mask &= ADDR_MASK;
@@ -100,6 +392,9 @@ void configure_address_pins(uint32_t mask)
             gpio_set_input_enabled(gpio, false);
         }
     }
+
+    // gpio_init clears the override. Full size images have no second half.
+    select_image((mask & IMAGE_SELECT_BIT) ? 0 : image_base);
 }
 
 static uint8_t identify_request = 0;
@@ -158,16 +453,77 @@ bool activity_timer_callback(repeating_timer_t * /*unused*/)
 }
 #endif // ACTIVITY_LED==1
 
-int main()
+// Long enough for the host to see the device go away
+static constexpr uint32_t USB_REENUMERATE_MS = 250;
+
+// The target may come out of reset at the same time as us. The ends of the
+// image, where reset vectors live, are loaded first and served while the rest
+// is copied.
+static constexpr uint32_t BOOT_VECTOR_SIZE = FLASH_SECTOR_SIZE;
+
+// Time since reset until the ends of the image were served and until all of it was loaded
+static uint32_t boot_serving_us = 0;
+static uint32_t boot_loaded_us = 0;
+
+// The slot to load at startup, slot 0 unless another one has been chosen
+static uint boot_slot()
 {
-    tusb_init();
+    uint slot = config.boot_slot;
+    if (!slot_available(slot) || config.slots[slot].addr_mask == 0)
+    {
+        slot = 0;
+    }
+    return slot;
+}
+
+static void boot_rom_service(uint boot_slot)
+{
+    // Uncached so the copy doesn't evict anything from XIP
+    const uint8_t *src = (const uint8_t *)(XIP_NOCACHE_NOALLOC_BASE + flash_slot_offset(boot_slot));
+    uint8_t *dest = rom_get_buffer();
+
+    uint32_t image_size = (config.addr_mask & ADDR_MASK) + 1;
+    if (image_size <= 2 * BOOT_VECTOR_SIZE)
+    {
+        dma_copy(dest, src, image_size);
+    }
+    else
+    {
+        dma_copy(dest, src, BOOT_VECTOR_SIZE);
+        uint32_t top = image_size - BOOT_VECTOR_SIZE;
+        dma_copy(dest + top, src + top, BOOT_VECTOR_SIZE);
+    }
+
+    rom_service_start(config.addr_mask);
+    boot_serving_us = time_us_32();
 
+    // Rewrites the top end with the same bytes, which is harmless while serving
+    dma_copy(dest + BOOT_VECTOR_SIZE, src + BOOT_VECTOR_SIZE, ROM_SIZE - BOOT_VECTOR_SIZE);
+    boot_loaded_us = time_us_32();
+}
+
+int main()
+{
     init_config();
 
-    set_sys_clock_khz(160000, true);
+    apply_clock_profile(config.clock_profile);
+
+    // The mask of the last SetMask may belong to an upload that was never committed
+    uint slot = boot_slot();
+    if (config.slots[slot].addr_mask != 0)
+    {
+        config.addr_mask = config.slots[slot].addr_mask;
+    }
 
     configure_address_pins(config.addr_mask);
 
+    rom_init_programs();
+
+    boot_rom_service(slot);
+
+    usb_set_serial(config.name);
+    tusb_init();
+
 #if ACTIVITY_LED==1
     identify_ack = identify_request = 0;
 
@@ -178,19 +534,28 @@ int main()
     add_repeating_timer_ms(10, activity_timer_callback, nullptr, &activity_timer);
 #endif
 
-    memcpy(rom_get_buffer(), flash_rom_data, ROM_SIZE);
-
-    rom_init_programs();
+    trace_init();
 
     comms_init();
 
-    rom_service_start();
+    trigger_init(rom_get_buffer());
 
     while (true)
     {
         // Reset state
         rom_offset = 0;
+        write_seq_receiving = write_seq_done = writes_unacked = 0;
         comms_end_session();
+        trigger_reset();
+        flush_config();
+
+        // A rename only reaches the serial number when the host enumerates us again
+        if (usb_set_serial(config.name))
+        {
+            tud_disconnect();
+            sleep_ms(USB_REENUMERATE_MS);
+            tud_connect();
+        }
 
         pl_wait_for_connection();
 
@@ -200,13 +565,36 @@ int main()
         while (pl_is_connected())
         {
             uint32_t addr = sio_hw->gpio_in & config.addr_mask;
-            if( !comms_update(nullptr, 0, 5000) )
+            if( !comms_update(5000) )
             {
-                pl_send_error("Comms Update Timeout", 0, 0);
+                pl_send_error("Comms send timeout", 0, 0);
             }
 
+            trigger_update();
+            config_update();
+
             const Packet *req = pl_poll();
 
+            if (write_seq_receiving != 0 && !pl_bulk_active())
+            {
+                if (pl_bulk_complete())
+                {
+                    write_seq_done = write_seq_receiving;
+                    writes_unacked++;
+                }
+                else
+                {
+                    report_bulk_write_error(write_seq_receiving, write_offset, write_size, "Bulk write decode failed");
+                }
+                write_seq_receiving = 0;
+            }
+
+            if (writes_unacked > 0 && (req == nullptr || writes_unacked >= WRITE_ACK_INTERVAL))
+            {
+                pl_send_payload(PacketType::WriteAck, &write_seq_done, sizeof(write_seq_done));
+                writes_unacked = 0;
+            }
+
             if (req)
             {
                 switch((PacketType)req->type)
@@ -250,6 +638,129 @@ int main()
                         break;
                     }
 
+                    case PacketType::WriteBulk:
+                    {
+                        uint32_t size;
+                        uint32_t seq = 0; // unsequenced
+                        uint8_t lane = 0;
+                        memcpy(&size, req->payload, sizeof(uint32_t));
+                        if (req->size >= 8)
+                        {
+                            memcpy(&seq, req->payload + 4, sizeof(uint32_t));
+                        }
+                        if (req->size >= 9)
+                        {
+                            lane = req->payload[8];
+                        }
+
+                        // With a lane only every other byte of the stream is for this device
+                        uint32_t stored = size;
+                        if (lane == 1) stored = (size + 1) / 2;
+                        if (lane == 2) stored = size / 2;
+
+                        uint32_t offset = rom_offset;
+                        if (lane > 2 || offset > ROM_SIZE || stored > (ROM_SIZE - offset))
+                        {
+                            reject_bulk_write(seq, offset, size);
+                            break;
+                        }
+                        if (lane == 0)
+                        {
+                            pl_begin_bulk(rom_get_buffer() + offset, size);
+                        }
+                        else
+                        {
+                            pl_begin_bulk_lane(rom_get_buffer() + offset, size, lane - 1);
+                        }
+                        rom_offset += stored;
+                        write_seq_receiving = seq;
+                        write_offset = offset;
+                        write_size = size;
+                        break;
+                    }
+
+                    case PacketType::WriteCompressed:
+                    {
+                        // Without the length there is no telling how much data to discard
+                        if (req->size < 12)
+                        {
+                            pl_send_error("Compressed write header too short", req->size, 12);
+                            break;
+                        }
+
+                        uint32_t size, seq, decoded;
+                        memcpy(&size, req->payload, sizeof(uint32_t));
+                        memcpy(&seq, req->payload + 4, sizeof(uint32_t));
+                        memcpy(&decoded, req->payload + 8, sizeof(uint32_t));
+
+                        uint32_t offset = rom_offset;
+                        if (offset > ROM_SIZE || decoded > (ROM_SIZE - offset))
+                        {
+                            reject_bulk_write(seq, offset, size);
+                            break;
+                        }
+                        pl_begin_bulk_rle(rom_get_buffer() + offset, size, decoded);
+                        rom_offset += decoded;
+                        write_seq_receiving = seq;
+                        write_offset = offset;
+                        write_size = size;
+                        break;
+                    }
+
+                    case PacketType::Fill:
+                    {
+                        if (req->size < 9)
+                        {
+                            pl_send_error("Fill request too short", req->size, 9);
+                            break;
+                        }
+
+                        uint32_t offset, len;
+                        memcpy(&offset, req->payload, sizeof(uint32_t));
+                        memcpy(&len, req->payload + 4, sizeof(uint32_t));
+                        uint8_t value = req->payload[8];
+
+                        if (offset > ROM_SIZE || len > (ROM_SIZE - offset))
+                        {
+                            pl_send_error("Fill out of range", offset, len);
+                            break;
+                        }
+                        if (len > 0) dma_fill(rom_get_buffer() + offset, value, len);
+                        pl_send_null(PacketType::Done);
+                        break;
+                    }
+
+                    case PacketType::Copy:
+                    {
+                        if (req->size < 12)
+                        {
+                            pl_send_error("Copy request too short", req->size, 12);
+                            break;
+                        }
+
+                        uint32_t src, dest, len;
+                        memcpy(&src, req->payload, sizeof(uint32_t));
+                        memcpy(&dest, req->payload + 4, sizeof(uint32_t));
+                        memcpy(&len, req->payload + 8, sizeof(uint32_t));
+
+                        if (src > ROM_SIZE || len > (ROM_SIZE - src) || dest > ROM_SIZE || len > (ROM_SIZE - dest))
+                        {
+                            pl_send_error("Copy out of range", src, dest);
+                            break;
+                        }
+
+                        // The DMA reads ahead of its writes, copying forward when the
+                        // destination starts inside the source would be unpredictable.
+                        if (dest > src && dest < src + len)
+                        {
+                            pl_send_error("Copy regions overlap", src, dest);
+                            break;
+                        }
+                        if (len > 0) dma_copy(rom_get_buffer() + dest, rom_get_buffer() + src, len);
+                        pl_send_null(PacketType::Done);
+                        break;
+                    }
+
                     case PacketType::Read:
                     {
                         uint32_t offset = rom_offset;
@@ -259,18 +770,147 @@ int main()
                         break;
                     }
 
+                    case PacketType::ReadBulk:
+                    {
+                        uint32_t size;
+                        memcpy(&size, req->payload, sizeof(uint32_t));
+
+                        uint32_t offset = rom_offset;
+                        if (offset > ROM_SIZE || size > (ROM_SIZE - offset))
+                        {
+                            pl_send_error("Bulk read out of range", offset, size);
+                            break;
+                        }
+                        pl_send_bulk(PacketType::ReadBulkData, rom_get_buffer() + offset, size);
+                        rom_offset += size;
+                        break;
+                    }
+
+                    case PacketType::Checksum:
+                    {
+                        uint32_t offset, size;
+                        memcpy(&offset, req->payload, sizeof(uint32_t));
+                        memcpy(&size, req->payload + 4, sizeof(uint32_t));
+                        ChecksumSource source = ChecksumSource::Ram;
+                        if (req->size > 8)
+                        {
+                            source = (ChecksumSource)req->payload[8];
+                        }
+
+                        if (offset > ROM_SIZE || size > (ROM_SIZE - offset))
+                        {
+                            pl_send_error("Checksum out of range", offset, size);
+                            break;
+                        }
+
+                        const uint8_t *base = source == ChecksumSource::Flash ? flash_rom_data : rom_get_buffer();
+                        uint32_t crc = dma_crc32(base + offset, size);
+                        pl_send_payload(PacketType::ChecksumResult, &crc, sizeof(crc));
+                        break;
+                    }
+
+                    case PacketType::BlockChecksums:
+                    {
+                        uint32_t offset, block_size, count;
+                        memcpy(&offset, req->payload, sizeof(uint32_t));
+                        memcpy(&block_size, req->payload + 4, sizeof(uint32_t));
+                        memcpy(&count, req->payload + 8, sizeof(uint32_t));
+
+                        if (block_size == 0 || offset > ROM_SIZE || count > ((ROM_SIZE - offset) / block_size))
+                        {
+                            pl_send_error("Block checksums out of range", offset, block_size);
+                            break;
+                        }
+
+                        // Sent as they are calculated, there isn't the ram to hold them all
+                        uint32_t crcs[8];
+                        pl_send_bulk_header(PacketType::BlockChecksumsData, count * sizeof(uint32_t));
+                        for (uint32_t block = 0; block < count; block += count_of(crcs))
+                        {
+                            uint32_t n = MIN(count - block, count_of(crcs));
+                            for (uint32_t i = 0; i < n; i++)
+                            {
+                                crcs[i] = dma_crc32(rom_get_buffer() + offset + ((block + i) * block_size), block_size);
+                            }
+                            pl_send_raw(crcs, n * sizeof(uint32_t));
+                        }
+                        break;
+                    }
+
                     case PacketType::CommitFlash:
                     {
-                        save_rom();
+                        uint32_t written = save_rom(0);
+                        pl_send_debug("Sectors committed", written, ROM_SIZE / FLASH_SECTOR_SIZE);
                         pl_send_null(PacketType::CommitDone);
                         break;
                     }
 
+                    case PacketType::CommitSlot:
+                    {
+                        if (req->size == 0)
+                        {
+                            pl_send_error("Missing slot number", 0, N_FLASH_SLOTS);
+                            break;
+                        }
+
+                        uint slot = req->payload[0];
+                        if (!slot_available(slot))
+                        {
+                            pl_send_error("Invalid slot", slot, N_FLASH_SLOTS);
+                            break;
+                        }
+
+                        uint32_t written = save_rom(slot);
+                        pl_send_debug("Sectors committed", written, ROM_SIZE / FLASH_SECTOR_SIZE);
+                        pl_send_null(PacketType::CommitDone);
+                        break;
+                    }
+
+                    case PacketType::LoadSlot:
+                    {
+                        if (req->size == 0)
+                        {
+                            pl_send_error("Missing slot number", 0, N_FLASH_SLOTS);
+                            break;
+                        }
+
+                        uint slot = req->payload[0];
+                        bool boot = req->size > 1 && req->payload[1];
+                        if (!slot_available(slot) || config.slots[slot].addr_mask == 0)
+                        {
+                            pl_send_error("Slot is empty", slot, N_FLASH_SLOTS);
+                            break;
+                        }
+
+                        comms_end_session();
+                        trace_stop();
+
+                        // Uncached so the copy doesn't evict anything from XIP
+                        const uint8_t *src = (const uint8_t *)(XIP_NOCACHE_NOALLOC_BASE + flash_slot_offset(slot));
+                        dma_copy(rom_get_buffer(), src, ROM_SIZE);
+
+                        config.addr_mask = config.slots[slot].addr_mask;
+                        configure_address_pins(config.addr_mask);
+                        rom_service_start(config.addr_mask);
+
+                        if (boot)
+                        {
+                            config.boot_slot = slot;
+                            save_config();
+                        }
+
+                        // What was loaded and what was committed, the host checks them
+                        uint32_t crcs[2] = { dma_crc32(rom_get_buffer(), ROM_SIZE), config.slots[slot].crc };
+                        pl_send_payload(PacketType::SlotLoaded, crcs, sizeof(crcs));
+                        break;
+                    }
+
                     case PacketType::CommsStart:
                     {
                         uint32_t addr;
                         memcpy(&addr, req->payload, 4);
-                        comms_begin_session(addr, rom_get_buffer());
+                        bool block = req->size > 4 && req->payload[4] != 0;
+                        comms_begin_session(addr | image_base, rom_get_buffer(), block);
                         pl_send_debug("Comms Started", addr, 0);
                         break;
                     }
@@ -279,14 +919,16 @@ int main()
                     {
                         comms_end_session();
                         pl_send_debug("Comms Ended", 0, 0);
+                        pl_send_null(PacketType::Done);
                         break;
                     }
 
                     case PacketType::CommsData:
                     {
-                        if( !comms_update(req->payload, req->size, 5000) )
+                        // The host only sends as much as it has credit for, see CommsCredit
+                        if (!comms_queue(req->payload, req->size))
                         {
-                            pl_send_error("Comms send timeout", 0, 0);
+                            pl_send_error("Comms data overflow", req->size, COMMS_STAGING_SIZE);
                         }
                         break;
                     }
@@ -297,6 +939,9 @@ int main()
                         memcpy(&mask, req->payload, 4);
                         config.addr_mask = mask;
                         configure_address_pins(mask);
+                        rom_service_start(mask);
+                        save_config();
+                        if (!trace_fits()) trace_stop();
                         break;
                     }
 
@@ -306,6 +951,165 @@ int main()
                         break;
                     }
 
+                    case PacketType::GetImage:
+                    {
+                        pl_send_payload(PacketType::CurImage, &image_base, sizeof(image_base));
+                        break;
+                    }
+
+                    case PacketType::SwapImage:
+                    {
+                        if (config.addr_mask & IMAGE_SELECT_BIT)
+                        {
+                            pl_send_error("Image too large to swap", config.addr_mask, 0);
+                            break;
+                        }
+
+                        // The comms area belongs to the image that is being replaced
+                        comms_end_session();
+                        select_image(image_base ^ IMAGE_SELECT_BIT);
+                        if (!trace_fits()) trace_stop();
+                        trigger_set_base(image_base);
+                        pl_send_payload(PacketType::CurImage, &image_base, sizeof(image_base));
+                        break;
+                    }
+
+                    case PacketType::LatencyTest:
+                    {
+                        uint16_t samples = 256;
+                        if (req->size >= 2)
+                        {
+                            memcpy(&samples, req->payload, sizeof(uint16_t));
+                        }
+
+                        // Needs pio1 and the ROM image to itself
+                        comms_end_session();
+                        trigger_suspend();
+
+                        struct
+                        {
+                            uint32_t sys_khz;
+                            LatencyStats addr;
+                            LatencyStats oe;
+                        } result;
+
+                        result.sys_khz = clock_get_hz(clk_sys) / 1000;
+                        latency_measure(rom_get_buffer() + image_base, samples, &result.addr, &result.oe);
+                        configure_address_pins(config.addr_mask);
+
+                        comms_load_programs();
+                        trigger_resume();
+
+                        pl_send_payload(PacketType::LatencyResult, &result, sizeof(result));
+                        break;
+                    }
+
+                    case PacketType::GetBootTime:
+                    {
+                        uint32_t times[2] = { boot_serving_us, boot_loaded_us };
+                        pl_send_payload(PacketType::BootTime, times, sizeof(times));
+                        break;
+                    }
+
+                    case PacketType::GetStats:
+                    {
+                        stats.uptime_ms = to_ms_since_boot(get_absolute_time());
+                        pl_send_bulk(PacketType::StatsData, &stats, sizeof(stats));
+                        break;
+                    }
+
+                    case PacketType::SetClock:
+                    {
+                        if (req->size < 4)
+                        {
+                            pl_send_error("Missing clock profile", req->size, 4);
+                            break;
+                        }
+
+                        uint32_t profile;
+                        memcpy(&profile, req->payload, sizeof(uint32_t));
+                        if (profile >= N_CLOCK_PROFILES)
+                        {
+                            pl_send_error("Invalid clock profile", profile, N_CLOCK_PROFILES);
+                            break;
+                        }
+
+                        config.clock_profile = profile;
+                        save_config();
+                        apply_clock_profile(profile);
+                        [[fallthrough]];
+                    }
+
+                    case PacketType::GetClock:
+                    {
+                        uint32_t clock[2] = { config.clock_profile, clock_get_hz(clk_sys) / 1000 };
+                        pl_send_payload(PacketType::CurClock, clock, sizeof(clock));
+                        break;
+                    }
+
+                    case PacketType::TraceStart:
+                    {
+                        if (!trace_fits())
+                        {
+                            pl_send_error("Image overlaps the trace buffer", image_base + config.addr_mask, TRACE_BUFFER_OFFSET);
+                        }
+                        else if (!trace_start())
+                        {
+                            pl_send_error("Trace not available", 0, 0);
+                        }
+                        else
+                        {
+                            pl_send_null(PacketType::Done);
+                        }
+                        break;
+                    }
+
+                    case PacketType::TraceRead:
+                    {
+                        trace_send();
+                        break;
+                    }
+
+                    case PacketType::CoverageStart:
+                    {
+                        if (!trace_fits())
+                        {
+                            pl_send_error("Image overlaps the trace buffer", image_base + config.addr_mask, TRACE_BUFFER_OFFSET);
+                        }
+                        else if (!coverage_start())
+                        {
+                            pl_send_error("Coverage not available", 0, 0);
+                        }
+                        else
+                        {
+                            pl_send_null(PacketType::Done);
+                        }
+                        break;
+                    }
+
+                    case PacketType::CoverageRead:
+                    {
+                        coverage_send(req->size > 0 && req->payload[0] != 0);
+                        break;
+                    }
+
+                    case PacketType::SetTrigger:
+                    {
+                        if (req->size < sizeof(TriggerConfig))
+                        {
+                            pl_send_error("Trigger too short", req->size, sizeof(TriggerConfig));
+                            break;
+                        }
+
+                        TriggerConfig trigger;
+                        memcpy(&trigger, req->payload, sizeof(trigger));
+                        if (!trigger_set(trigger, image_base))
+                        {
+                            pl_send_error("Invalid trigger", trigger.index, N_TRIGGERS);
+                        }
+                        break;
+                    }
+
                     case PacketType::Identify:
                     {
                         identify_request += 5;
@@ -318,8 +1122,20 @@ int main()
                         break;
                     }
                 }
+
                 pl_consume_packet(req);
             }
+#if IDLE_SLEEP==1
+            else if (writes_unacked == 0 && write_seq_receiving == 0)
+            {
+                // Sleep until the next interrupt, USB, comms and the triggers all raise one.
+                // A pending config write keeps it awake until it's flushed.
+                // They are held off while checking so one can't slip in before the wfi.
+                uint32_t ints = save_and_disable_interrupts();
+                if (pl_idle() && comms_idle() && trigger_idle() && config_idle()) __wfi();
+                restore_interrupts(ints);
+            }
+#endif
         }
     }
 }
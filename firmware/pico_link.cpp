@@ -1,33 +1,171 @@
 #include "pico_link.h"
 
 #include "pico/stdlib.h"
+#include "pico/bootrom.h"
 #include <string.h>
 #include <unistd.h>
 #include <tusb.h>
 
+#include "usb_descriptors.h"
+#include "stats.h"
+
 
 static uint8_t incoming_buffer[sizeof(Packet)];
 static uint8_t incoming_count;
 
+enum class BulkMode : uint8_t
+{
+    Direct, // straight to bulk_dest
+    Lane,   // only every other byte is kept
+    Rle,    // run length decoded into bulk_dest, up to bulk_end
+};
+
+static uint8_t *bulk_dest;
+static uint32_t bulk_remaining;
+static BulkMode bulk_mode = BulkMode::Direct;
+static uint32_t bulk_lane;
+static uint32_t bulk_index;
+
+// Run length decoder state, carried across reads of the stream
+enum class RleState : uint8_t
+{
+    Control,
+    RunCount,
+    RunValue,
+    Literal,
+};
+
+static constexpr uint32_t RLE_MIN_RUN = 3;
+static uint8_t *bulk_end;
+static RleState rle_state;
+static uint32_t rle_count;
+static bool rle_overrun;
+
 static uint8_t activity_count = 0;
 static uint8_t activity_report = 0;
 
-void usb_send(const void *data, size_t len)
+// Queued packets are flushed once this much is waiting, or it has waited a frame
+static constexpr uint32_t QUEUE_FLUSH_BYTES = CFG_TUD_CDC_TX_BUFSIZE / 2;
+static constexpr int64_t QUEUE_FLUSH_US = 1000;
+static uint32_t queued_bytes = 0;
+static absolute_time_t queued_since;
+
+// The host can talk to us through either the CDC serial interface or the
+// vendor bulk interface, only one of them is in use for a session.
+enum class Link : uint8_t
+{
+    Cdc,
+    Vendor
+};
+
+static Link active_link = Link::Cdc;
+
+// Updated from the vendor control request handler
+static volatile bool vendor_connected = false;
+static volatile uint8_t vendor_session = 0;
+static uint8_t active_vendor_session = 0;
+
+static uint32_t link_available()
+{
+    return active_link == Link::Vendor ? tud_vendor_available() : tud_cdc_available();
+}
+
+static uint32_t link_read(void *buffer, uint32_t len)
+{
+    return active_link == Link::Vendor ? tud_vendor_read(buffer, len) : tud_cdc_read(buffer, len);
+}
+
+static uint32_t link_write(const void *buffer, uint32_t len)
+{
+    return active_link == Link::Vendor ? tud_vendor_write(buffer, len) : tud_cdc_write(buffer, len);
+}
+
+static void link_write_flush()
+{
+    if (active_link == Link::Vendor)
+    {
+        tud_vendor_write_flush();
+    }
+    else
+    {
+        tud_cdc_write_flush();
+    }
+}
+
+static void link_read_flush()
+{
+    if (active_link == Link::Vendor)
+    {
+        uint8_t discard[64];
+        while (tud_vendor_available())
+        {
+            tud_vendor_read(discard, sizeof(discard));
+        }
+    }
+    else
+    {
+        tud_cdc_read_flush();
+        tud_cdc_write_clear();
+    }
+}
+
+static bool usb_write(const void *data, size_t len)
 {
     const uint8_t *ptr = (const uint8_t *)data;
     uint32_t remaining = len;
+    bool waited = false;
 
     while (remaining > 0)
     {
-        uint32_t sent = tud_cdc_write(ptr, remaining);
+        uint32_t sent = link_write(ptr, remaining);
         ptr += sent;
         remaining -= sent;
+        if (remaining > 0 && !waited)
+        {
+            stats.usb_write_retries++;
+            waited = true;
+        }
         tud_task();
-    }
 
-    tud_cdc_write_flush();
+        if (!pl_is_connected()) return false;
+    }
 
     activity_count++;
+
+    return true;
+}
+
+void usb_send(const void *data, size_t len)
+{
+    if (!usb_write(data, len)) return;
+
+    link_write_flush();
+    queued_bytes = 0;
+}
+
+static void usb_queue(const void *data, size_t len)
+{
+    if (!usb_write(data, len)) return;
+
+    if (queued_bytes == 0) queued_since = get_absolute_time();
+    queued_bytes += len;
+
+    if (queued_bytes >= QUEUE_FLUSH_BYTES)
+    {
+        link_write_flush();
+        queued_bytes = 0;
+    }
+}
+
+void pl_flush_queued()
+{
+    if (queued_bytes == 0) return;
+
+    if (absolute_time_diff_us(queued_since, get_absolute_time()) >= QUEUE_FLUSH_US)
+    {
+        link_write_flush();
+        queued_bytes = 0;
+    }
 }
 
 
@@ -57,6 +195,15 @@ void pl_send_payload(PacketType type, const void *data, size_t len)
     usb_send(&pkt, pkt.size + 2);
 }
 
+void pl_queue_payload(PacketType type, const void *data, size_t len)
+{
+    Packet pkt;
+    pkt.type = (uint8_t)type;
+    pkt.size = MIN(len, MAX_PKT_PAYLOAD);
+    memcpy(pkt.payload, data, pkt.size);
+    usb_queue(&pkt, pkt.size + 2);
+}
+
 void pl_send_debug(const char *s, uint32_t v0, uint32_t v1)
 {
     Packet pkt;
@@ -79,20 +226,58 @@ void pl_send_error(const char *s, uint32_t v0, uint32_t v1)
     usb_send(&pkt, pkt.size + 2);
 }
 
+void pl_send_bulk_header(PacketType type, uint32_t len)
+{
+    pl_send_payload(type, &len, sizeof(len));
+}
+
+void pl_send_raw(const void *data, uint32_t len)
+{
+    usb_send(data, len);
+}
+
+void pl_send_bulk(PacketType type, const void *data, uint32_t len)
+{
+    pl_send_bulk_header(type, len);
+    pl_send_raw(data, len);
+}
+
 void pl_wait_for_connection()
 {
     // Wait for connection
-    while(!tud_cdc_connected())
+    while (true)
     {
         tud_task();
+
+        if (vendor_connected)
+        {
+            active_link = Link::Vendor;
+            active_vendor_session = vendor_session;
+            break;
+        }
+
+        if (tud_cdc_connected())
+        {
+            active_link = Link::Cdc;
+            break;
+        }
+
+#if IDLE_SLEEP==1
+        // The connection is made from the USB interrupt
+        uint32_t ints = save_and_disable_interrupts();
+        if (!tud_task_event_ready()) __wfi();
+        restore_interrupts(ints);
+#else
         sleep_ms(1);
+#endif
     }
 
     // Flush input
-    tud_cdc_read_flush();
-    tud_cdc_write_clear();
+    link_read_flush();
 
     incoming_count = 0;
+    bulk_dest = nullptr;
+    bulk_remaining = 0;
 
     activity_count = activity_report = 0;
 
@@ -102,46 +287,230 @@ void pl_wait_for_connection()
 
 bool pl_is_connected()
 {
+    if (active_link == Link::Vendor)
+    {
+        // A new connect request starts a new session
+        return vendor_connected && active_vendor_session == vendor_session;
+    }
     return tud_cdc_connected();
 }
 
+void pl_begin_bulk(uint8_t *dest, uint32_t len)
+{
+    bulk_dest = dest;
+    bulk_remaining = len;
+    bulk_mode = BulkMode::Direct;
+}
+
+void pl_begin_bulk_lane(uint8_t *dest, uint32_t len, uint32_t lane)
+{
+    bulk_dest = dest;
+    bulk_remaining = len;
+    bulk_mode = BulkMode::Lane;
+    bulk_lane = lane & 1;
+    bulk_index = 0;
+}
+
+void pl_begin_bulk_rle(uint8_t *dest, uint32_t len, uint32_t dest_len)
+{
+    bulk_dest = dest;
+    bulk_end = dest + dest_len;
+    bulk_remaining = len;
+    bulk_mode = BulkMode::Rle;
+    rle_state = RleState::Control;
+    rle_overrun = false;
+}
+
+bool pl_bulk_active()
+{
+    return bulk_remaining > 0;
+}
+
+bool pl_bulk_complete()
+{
+    if (bulk_mode != BulkMode::Rle) return true;
+    return !rle_overrun && rle_state == RleState::Control && bulk_dest == bulk_end;
+}
+
+static void rle_decode(const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+    {
+        uint8_t b = data[i];
+        switch (rle_state)
+        {
+            case RleState::Control:
+                if (b < 0x80)
+                {
+                    rle_count = b + 1;
+                    rle_state = RleState::Literal;
+                }
+                else
+                {
+                    rle_count = (b & 0x7f) << 8;
+                    rle_state = RleState::RunCount;
+                }
+                break;
+
+            case RleState::RunCount:
+                rle_count = (rle_count | b) + RLE_MIN_RUN;
+                rle_state = RleState::RunValue;
+                break;
+
+            case RleState::RunValue:
+            {
+                uint32_t count = MIN(rle_count, (uint32_t)(bulk_end - bulk_dest));
+                if (count < rle_count) rle_overrun = true;
+                memset(bulk_dest, b, count);
+                bulk_dest += count;
+                rle_state = RleState::Control;
+                break;
+            }
+
+            case RleState::Literal:
+                if (bulk_dest < bulk_end) *bulk_dest++ = b;
+                else rle_overrun = true;
+                if (--rle_count == 0) rle_state = RleState::Control;
+                break;
+        }
+    }
+}
+
+static void bulk_poll()
+{
+    uint32_t read_size = MIN(link_available(), bulk_remaining);
+    if (read_size == 0) return;
+
+    uint32_t remaining = bulk_remaining;
+
+    if (bulk_dest && bulk_mode == BulkMode::Direct)
+    {
+        // Straight from the USB FIFO to its destination, no intermediate copy
+        uint32_t count = link_read(bulk_dest, read_size);
+        bulk_dest += count;
+        bulk_remaining -= count;
+    }
+    else if (bulk_dest)
+    {
+        uint8_t buffer[64];
+        uint32_t count = link_read(buffer, MIN(read_size, sizeof(buffer)));
+        if (bulk_mode == BulkMode::Rle)
+        {
+            rle_decode(buffer, count);
+        }
+        else
+        {
+            for (uint32_t i = 0; i < count; i++, bulk_index++)
+            {
+                if ((bulk_index & 1) == bulk_lane) *bulk_dest++ = buffer[i];
+            }
+        }
+        bulk_remaining -= count;
+    }
+    else
+    {
+        uint32_t count = link_read(incoming_buffer, MIN(read_size, sizeof(incoming_buffer)));
+        bulk_remaining -= count;
+    }
+
+    stats.bulk_bytes += remaining - bulk_remaining;
+    activity_count++;
+}
+
+bool pl_idle()
+{
+    // Packets after the current one stay in the USB FIFO without raising another event
+    return queued_bytes == 0 && bulk_remaining == 0 && incoming_count == 0 && link_available() == 0 &&
+           !tud_task_event_ready();
+}
+
 const Packet *pl_poll()
 {
     tud_task();
 
-    uint32_t space = sizeof(incoming_buffer) - incoming_count;
-    uint32_t rx_avail = tud_cdc_available();
+    pl_flush_queued();
 
-    uint32_t read_size = MIN(rx_avail, space);
-    if (read_size > 0)
+    if (bulk_remaining > 0)
     {
-        incoming_count += tud_cdc_read(incoming_buffer + incoming_count, read_size);
+        bulk_poll();
+        if (bulk_remaining > 0) return nullptr;
     }
 
-    if (incoming_count >= 2)
+    // Never read beyond the end of the current packet. Whatever follows it,
+    // bulk data in particular, stays in the USB FIFO until it is asked for.
+    Packet *pkt = (Packet *)incoming_buffer;
+    while (true)
     {
-        Packet *pkt = (Packet *)incoming_buffer;
-        if ((pkt->size + 2) <= incoming_count)
+        uint32_t needed = incoming_count < 2 ? 2 : (pkt->size + 2);
+        if (needed > sizeof(incoming_buffer))
+        {
+            // Only the header has been read, the payload would be taken for packets
+            pl_send_error("Packet too large", pkt->type, pkt->size);
+            pl_begin_bulk(nullptr, pkt->size);
+            incoming_count = 0;
+            return nullptr;
+        }
+
+        if (incoming_count >= needed)
         {
             activity_count++;
             return pkt;
         }
+
+        uint32_t read_size = MIN(link_available(), needed - incoming_count);
+        if (read_size == 0) return nullptr;
+
+        incoming_count += link_read(incoming_buffer + incoming_count, read_size);
     }
-    
-    return nullptr;
 }
 
-void pl_consume_packet(const Packet *pkt)
+void pl_consume_packet(const Packet * /*pkt*/)
+{
+    // pl_poll only ever holds a single packet
+    incoming_count = 0;
+    stats.packets++;
+}
+
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, const tusb_control_request_t *request)
 {
-    uint32_t used = pkt->size + 2;
-    uint32_t remaining = incoming_count - used;
+    if (stage != CONTROL_STAGE_SETUP) return true;
+    if (request->bmRequestType_bit.type != TUSB_REQ_TYPE_VENDOR) return false;
 
-    if (remaining > 0)
+    switch (request->bRequest)
     {
-        memmove(incoming_buffer, incoming_buffer + used, remaining);
+        case VENDOR_REQUEST_MICROSOFT:
+        {
+            if (request->wIndex != 7) return false;
+
+            uint16_t len;
+            const uint8_t *desc = usb_ms_os_20_descriptor(&len);
+            return tud_control_xfer(rhport, request, (void *)desc, len);
+        }
+
+        case VENDOR_REQUEST_CONNECT:
+        {
+            vendor_connected = request->wValue != 0;
+            vendor_session++;
+            return tud_control_status(rhport, request);
+        }
+
+        default:
+            return false;
     }
+}
 
-    incoming_count = remaining;
+void tud_umount_cb()
+{
+    vendor_connected = false;
+}
+
+// Keep the SDK's magic baud rate reboot to BOOTSEL, without stdio_usb it is up to us
+void tud_cdc_line_coding_cb(uint8_t /*itf*/, const cdc_line_coding_t *line_coding)
+{
+    if (line_coding->bit_rate == 1200)
+    {
+        reset_usb_boot(0, 0);
+    }
 }
 
 bool pl_check_activity()
@@ -24,15 +24,72 @@ enum class PacketType : uint8_t
     CommitFlash = 12,
     CommitDone = 13,
 
-    CommsStart = 80,
+    WriteBulk = 14, // payload is the length, then the sequence number and the byte lane (0 all, 1 even, 2 odd)
+    WriteAck = 15,
+    WriteError = 16,
+    Checksum = 17,
+    ChecksumResult = 18,
+    ReadBulk = 19,
+    ReadBulkData = 20,
+    BlockChecksums = 21,
+    BlockChecksumsData = 22,
+
+    GetImage = 23,
+    CurImage = 24,
+    SwapImage = 25,
+
+    CommitSlot = 26,
+    LoadSlot = 27,
+    SlotLoaded = 28,
+
+    LatencyTest = 29,
+    LatencyResult = 30,
+
+    SetClock = 31,
+    GetClock = 32,
+    CurClock = 33,
+
+    TraceStart = 34,
+    TraceRead = 35,
+    TraceData = 36, // bulk, the payload is the length then the total number of accesses
+
+    CoverageStart = 37,
+    CoverageRead = 38, // payload is 1 to clear the map once it has been sent
+    CoverageData = 39, // bulk
+
+    SetTrigger = 40, // payload is a TriggerConfig
+    TriggerHit = 41,
+
+    GetBootTime = 42,
+    BootTime = 43, // payload is the time in us until the ROM was served and until it was fully loaded
+
+    WriteCompressed = 44, // payload is the length, the sequence number and the decoded length, see pl_begin_bulk_rle
+
+    Fill = 45, // payload is the offset, length and byte value, answered with Done
+    Copy = 46, // payload is the source offset, destination offset and length, answered with Done
+
+    GetStats = 47,
+    StatsData = 48, // bulk, a Stats
+
+    Done = 49, // acknowledges a request that has no reply of its own
+
+    CommsStart = 80, // payload is the address, then 1 for block mode
     CommsEnd = 81,
     CommsData = 82,
+    CommsCredit = 83, // payload is the number of staged bytes the target has taken, the host can send that many more
 
     Identify = 0xf8,
     Error = 0xfe,
     Debug = 0xff
 };
 
+// Memory a Checksum request is calculated over
+enum class ChecksumSource : uint8_t
+{
+    Ram = 0,   // the image being served
+    Flash = 1, // the image committed to flash
+};
+
 static constexpr size_t MAX_PKT_PAYLOAD = 30;
 
 struct Packet
@@ -49,11 +106,45 @@ void pl_send_payload(PacketType type, const void *data, size_t len);
 void pl_send_debug(const char *s, uint32_t v0, uint32_t v1);
 void pl_send_error(const char *s, uint32_t v0, uint32_t v1);
 
+// Send a packet without flushing it straight away, for streams where filling
+// USB packets matters more than latency. pl_poll flushes anything left waiting.
+void pl_queue_payload(PacketType type, const void *data, size_t len);
+void pl_flush_queued();
+
+// Send a packet whose payload is len, followed by len raw bytes from data
+void pl_send_bulk(PacketType type, const void *data, uint32_t len);
+
+// The same in pieces, the header then the raw data in as many parts as needed
+void pl_send_bulk_header(PacketType type, uint32_t len);
+void pl_send_raw(const void *data, uint32_t len);
+
 void pl_wait_for_connection();
 bool pl_is_connected();
 const Packet *pl_poll();
+
+// Nothing is left to do until the next USB interrupt
+bool pl_idle();
 void pl_consume_packet(const Packet *pkt);
 
+// Route the next len bytes of the incoming stream to dest without packet framing.
+// dest can be nullptr to discard the bytes. pl_poll returns nothing until done.
+void pl_begin_bulk(uint8_t *dest, uint32_t len);
+
+// The same but only keeping the even (lane 0) or odd (lane 1) bytes, which
+// lets two devices each take their half of a 16-bit image from the same stream.
+void pl_begin_bulk_lane(uint8_t *dest, uint32_t len, uint32_t lane);
+
+// The same but run length decoding the stream, writing at most dest_len bytes.
+// Each control byte c below 0x80 is followed by c + 1 literal bytes. Otherwise
+// c & 0x7f and the next byte are the high and low bits of a count, and the byte
+// after that is repeated count + 3 times.
+void pl_begin_bulk_rle(uint8_t *dest, uint32_t len, uint32_t dest_len);
+bool pl_bulk_active();
+
+// Whether the finished bulk transfer wrote exactly what it was begun with. Only
+// a run length encoded one can decode to more or less than dest_len.
+bool pl_bulk_complete();
+
 bool pl_check_activity();
 
 
@@ -1,8 +1,10 @@
 #include "hardware/structs/bus_ctrl.h"
+#include "hardware/dma.h"
 #include "pico/multicore.h"
 
 #include "rom.h"
 #include "system.h"
+#include "stats.h"
 
 #include "data_bus.pio.h"
 
@@ -10,11 +12,31 @@ static PIO data_pio = pio0;
 
 uint8_t *rom_data = (uint8_t *)0x21000000; // Start of 4 64kb sram banks
 
+static uint sm_data = 0;
+
+#if DMA_ROM_SERVICE==1
+// The address pins are sampled by a PIO state machine, producing the address
+// of the byte in rom_data. One DMA channel writes that into the read address
+// trigger of a second, which moves the byte to the data state machine and
+// chains back to the first.
+static uint sm_sample = 0;
+static uint offset_sample = 0;
+static int dma_addr_chan = -1;
+static int dma_data_chan = -1;
+#else
+// rom_loop must stay in ram and only touch ram, SIO and the PIO, flash is
+// written while it runs (see BACKGROUND_FLASH)
 uint32_t core1_stack[8];
+
+// Addresses above the mask mirror the image without relying on the disabled
+// address inputs. The image select bit is kept for images that fit in half
+// the buffer. Read once from ram before the loop starts.
+static uint32_t rom_loop_mask = ADDR_MASK;
+
 static void __attribute__((noreturn, section(".time_critical.core1_rom_loop"))) rom_loop()
 {
     register uint32_t r0 __asm__("r0") = (uint32_t)rom_data;
-    register uint32_t r1 __asm__("r1") = ADDR_MASK;
+    register uint32_t r1 __asm__("r1") = rom_loop_mask;
     register uint32_t r2 __asm__("r2") = (uint32_t)&data_pio->txf[0];
 
     __asm__ volatile (
@@ -33,10 +55,16 @@ static void __attribute__((noreturn, section(".time_critical.core1_rom_loop")))
     __builtin_unreachable();
 }
 
+static uint32_t loop_mask(uint32_t mask)
+{
+    return mask < IMAGE_SELECT_BIT ? mask | IMAGE_SELECT_BIT : mask;
+}
+#endif // DMA_ROM_SERVICE==1
+
 static uint sm_report = 0;
 void rom_init_programs()
 {
-    uint sm_data = pio_claim_unused_sm(data_pio, true);
+    sm_data = pio_claim_unused_sm(data_pio, true);
     uint sm_oe = pio_claim_unused_sm(data_pio, true);
     
     sm_report = pio_claim_unused_sm(data_pio, true);
@@ -102,6 +130,37 @@ void rom_init_programs()
     pio_sm_init(data_pio, sm_report, offset_report, &c_report);
     pio_sm_set_enabled(data_pio, sm_report, true);
 
+#if DMA_ROM_SERVICE==1
+    sm_sample = pio_claim_unused_sm(data_pio, true);
+
+    offset_sample = pio_add_program(data_pio, &address_sample_program);
+    pio_sm_config c_sample = address_sample_program_get_default_config(offset_sample);
+    sm_config_set_in_pins(&c_sample, BASE_ADDR_PIN);
+    sm_config_set_in_shift(&c_sample, false, false, 32);
+    sm_config_set_mov_status(&c_sample, STATUS_RX_LESSTHAN, 1);
+    pio_sm_init(data_pio, sm_sample, offset_sample, &c_sample);
+
+    dma_addr_chan = dma_claim_unused_channel(true);
+    dma_data_chan = dma_claim_unused_channel(true);
+
+    dma_channel_config c_dma_addr = dma_channel_get_default_config(dma_addr_chan);
+    channel_config_set_transfer_data_size(&c_dma_addr, DMA_SIZE_32);
+    channel_config_set_read_increment(&c_dma_addr, false);
+    channel_config_set_write_increment(&c_dma_addr, false);
+    channel_config_set_dreq(&c_dma_addr, pio_get_dreq(data_pio, sm_sample, false));
+    channel_config_set_high_priority(&c_dma_addr, true); // ahead of any other dma work
+    dma_channel_configure(dma_addr_chan, &c_dma_addr, &dma_hw->ch[dma_data_chan].al3_read_addr_trig,
+                          &data_pio->rxf[sm_sample], 1, false);
+
+    dma_channel_config c_dma_data = dma_channel_get_default_config(dma_data_chan);
+    channel_config_set_transfer_data_size(&c_dma_data, DMA_SIZE_8);
+    channel_config_set_read_increment(&c_dma_data, false);
+    channel_config_set_write_increment(&c_dma_data, false);
+    channel_config_set_dreq(&c_dma_data, pio_get_dreq(data_pio, sm_data, true));
+    channel_config_set_chain_to(&c_dma_data, dma_addr_chan);
+    channel_config_set_high_priority(&c_dma_data, true);
+    dma_channel_configure(dma_data_chan, &c_dma_data, &data_pio->txf[sm_data], rom_data, 1, false);
+#endif
 }
 
 uint8_t *rom_get_buffer()
@@ -109,25 +168,72 @@ uint8_t *rom_get_buffer()
     return rom_data;
 }
 
-void rom_service_start()
+// Restarting the service interrupts the target, so it is only done when needed
+static bool rom_serving = false;
+
+#if DMA_ROM_SERVICE==1
+// The sampled address has no bits for the disabled address inputs, so
+// mirroring is already done by configure_address_pins
+void rom_service_start(uint32_t /*addr_mask*/)
 {
+    if (rom_serving) return;
+
+    rom_service_stop();
+
+    // give dma bus priority
+    bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS;
+
+    pio_sm_restart(data_pio, sm_sample);
+    pio_sm_exec(data_pio, sm_sample, pio_encode_jmp(offset_sample));
+    pio_sm_put(data_pio, sm_sample, (uint32_t)rom_data >> 18);
+    pio_sm_set_enabled(data_pio, sm_sample, true);
+
+    dma_channel_start(dma_addr_chan);
+    rom_serving = true;
+}
+
+void rom_service_stop()
+{
+    rom_serving = false;
+
+    pio_sm_set_enabled(data_pio, sm_sample, false);
+    pio_sm_clear_fifos(data_pio, sm_sample);
+
+    // An in flight data transfer can chain to the address channel after it
+    // has been aborted, with no more samples it just waits so abort it again
+    dma_channel_abort(dma_addr_chan);
+    dma_channel_abort(dma_data_chan);
+    dma_channel_abort(dma_addr_chan);
+}
+#else
+void rom_service_start(uint32_t addr_mask)
+{
+    uint32_t mask = loop_mask(addr_mask & ADDR_MASK);
+    if (rom_serving && mask == rom_loop_mask) return;
+
+    rom_loop_mask = mask;
+
     // give core1 bus priority
     bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_PROC1_BITS;
 
     multicore_reset_core1();
     multicore_launch_core1_with_stack(rom_loop, core1_stack, sizeof(core1_stack));
+    rom_serving = true;
 }
 
 void rom_service_stop()
 {
+    rom_serving = false;
     multicore_reset_core1();
 }
+#endif // DMA_ROM_SERVICE==1
 
 bool rom_check_oe()
 {
     if( pio_interrupt_get(data_pio, sm_report) )
     {
         pio_interrupt_clear(data_pio, sm_report);
+        stats.rom_active_polls++;
         return true;
     }
     return false;
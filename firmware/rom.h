@@ -5,7 +5,9 @@
 
 void rom_init_programs();
 
-void rom_service_start();
+// Serve the image with addresses mirrored to the given mask. Does nothing if
+// it is already being served that way.
+void rom_service_start(uint32_t addr_mask);
 void rom_service_stop();
 
 uint8_t *rom_get_buffer();
@@ -0,0 +1,23 @@
+#if !defined(STATS_H)
+#define STATS_H 1
+
+#include <stdint.h>
+
+// Counters for diagnosing throughput, each is a single increment or add in the
+// path it counts. They run from boot and wrap, the host looks at differences.
+struct Stats
+{
+    uint32_t uptime_ms;         // filled in when sent
+    uint32_t packets;           // packets handled
+    uint32_t bulk_bytes;        // raw bytes received after bulk headers
+    uint32_t usb_write_retries; // writes that had to wait for room in the USB buffer
+    uint32_t comms_out_bytes;   // target to host
+    uint32_t comms_in_bytes;    // host to target
+    uint32_t comms_out_stalls;  // target writes held off because the out fifo was full
+    uint32_t comms_timeouts;    // host data dropped because the target stopped reading
+    uint32_t rom_active_polls;  // ~10ms activity LED polls that saw ROM reads, only with ACTIVITY_LED
+};
+
+extern Stats stats;
+
+#endif // STATS_H
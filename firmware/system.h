@@ -30,6 +30,11 @@ static constexpr uint32_t BASE_BUF_OE_PIN = 0;
 
 static constexpr uint32_t ROM_SIZE = 0x40000;
 static constexpr uint32_t ADDR_MASK = ROM_SIZE - 1;
+
+// Images up to half the buffer size can be double buffered. The top address
+// line is unused for them so its input is forced to pick which half is served.
+static constexpr uint32_t IMAGE_SELECT_BIT = ROM_SIZE >> 1;
+
 static constexpr uint32_t FLASH_SIZE = 2 * 1024 * 1024;
 
 #endif // SYSTEM_H
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include <string.h>
+
+#include "hardware/dma.h"
+#include "hardware/pio.h"
+
+#include "trace.h"
+#include "rom.h"
+#include "pico_link.h"
+
+#include "data_bus.pio.h"
+
+static PIO trace_pio = pio0;
+static int sm_trace = -1;
+static const pio_program_t *program_trace = nullptr;
+static uint offset_trace = 0;
+static int trace_chan = -1;
+
+static int coverage_addr_chan = -1;
+static int coverage_mark_chan = -1;
+
+enum class TraceMode
+{
+    Off,
+    Trace,
+    Coverage
+};
+
+static TraceMode trace_mode = TraceMode::Off;
+static uint32_t trace_written = 0;
+static bool coverage_valid = false;
+
+// Written by dma to every block that is read, in ram so it can be read while flash is busy
+static uint8_t coverage_mark = 1;
+
+static constexpr uint32_t TRACE_ENTRIES = TRACE_BUFFER_SIZE / sizeof(uint32_t);
+static constexpr uint32_t TRACE_TRANSFERS = 0xffffffff;
+
+static constexpr uint32_t TRACE_RUN_SHIFT = 18;
+static constexpr uint32_t TRACE_RUN_MAX = 1u << (32 - TRACE_RUN_SHIFT);
+
+static_assert((COVERAGE_MAP_OFFSET & 0xfff) == 0, "coverage_capture takes the map address >> 12");
+static_assert(COVERAGE_MAP_OFFSET + COVERAGE_BLOCKS <= ROM_SIZE);
+
+static const uint32_t *trace_buffer()
+{
+    return (const uint32_t *)(rom_get_buffer() + TRACE_BUFFER_OFFSET);
+}
+
+static uint8_t *coverage_map()
+{
+    return rom_get_buffer() + COVERAGE_MAP_OFFSET;
+}
+
+// Both capture programs don't fit alongside the rom programs, only the one in use is loaded
+static uint trace_load_program(const pio_program_t *program)
+{
+    if (program_trace != program)
+    {
+        if (program_trace) pio_remove_program(trace_pio, program_trace, offset_trace);
+        offset_trace = pio_add_program(trace_pio, program);
+        program_trace = program;
+    }
+    return offset_trace;
+}
+
+// Collapses sequential addresses into runs, either counting the records or sending them
+struct TraceEncoder
+{
+    bool send;
+    uint32_t records = 0;
+
+    uint32_t run_addr = 0;
+    uint32_t run_len = 0;
+
+    uint32_t batch[8];
+    uint32_t batched = 0;
+
+    void add(uint32_t addr)
+    {
+        if (run_len > 0 && run_len < TRACE_RUN_MAX && addr == run_addr + run_len)
+        {
+            run_len++;
+            return;
+        }
+
+        emit();
+        run_addr = addr;
+        run_len = 1;
+    }
+
+    void emit()
+    {
+        if (run_len == 0) return;
+
+        records++;
+        if (!send) return;
+
+        batch[batched++] = run_addr | ((run_len - 1) << TRACE_RUN_SHIFT);
+        if (batched == count_of(batch))
+        {
+            pl_send_raw(batch, sizeof(batch));
+            batched = 0;
+        }
+    }
+
+    void finish()
+    {
+        emit();
+        run_len = 0;
+        if (send && batched > 0)
+        {
+            pl_send_raw(batch, batched * sizeof(uint32_t));
+        }
+    }
+};
+
+void trace_init()
+{
+    sm_trace = pio_claim_unused_sm(trace_pio, false);
+    if (sm_trace < 0) return;
+
+    trace_chan = dma_claim_unused_channel(true);
+    coverage_addr_chan = dma_claim_unused_channel(true);
+    coverage_mark_chan = dma_claim_unused_channel(true);
+}
+
+bool trace_start()
+{
+    if (sm_trace < 0) return false;
+
+    trace_stop();
+
+    uint offset = trace_load_program(&trace_capture_program);
+    pio_sm_config c_sm = trace_capture_program_get_default_config(offset);
+    sm_config_set_in_pins(&c_sm, 0);
+    sm_config_set_out_shift(&c_sm, true, false, 32);
+    pio_sm_init(trace_pio, sm_trace, offset, &c_sm);
+
+    dma_channel_config c = dma_channel_get_default_config(trace_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, __builtin_ctz(TRACE_BUFFER_SIZE));
+    channel_config_set_dreq(&c, pio_get_dreq(trace_pio, sm_trace, false));
+    dma_channel_configure(trace_chan, &c, (void *)trace_buffer(), &trace_pio->rxf[sm_trace], TRACE_TRANSFERS, true);
+
+    pio_sm_set_enabled(trace_pio, sm_trace, true);
+
+    trace_mode = TraceMode::Trace;
+    trace_written = 0;
+    coverage_valid = false;
+
+    return true;
+}
+
+void trace_stop()
+{
+    if (trace_mode == TraceMode::Off) return;
+
+    pio_sm_set_enabled(trace_pio, sm_trace, false);
+
+    if (trace_mode == TraceMode::Trace)
+    {
+        // Let the dma collect whatever is left in the fifo
+        while (!pio_sm_is_rx_fifo_empty(trace_pio, sm_trace) && dma_channel_is_busy(trace_chan))
+        {
+            tight_loop_contents();
+        }
+
+        trace_written = TRACE_TRANSFERS - dma_hw->ch[trace_chan].transfer_count;
+        dma_channel_abort(trace_chan);
+    }
+    else
+    {
+        while (!pio_sm_is_rx_fifo_empty(trace_pio, sm_trace) || dma_channel_is_busy(coverage_mark_chan))
+        {
+            tight_loop_contents();
+        }
+
+        dma_channel_abort(coverage_addr_chan);
+        dma_channel_abort(coverage_mark_chan);
+    }
+
+    trace_mode = TraceMode::Off;
+}
+
+void trace_send()
+{
+    trace_stop();
+
+    // Oldest first, once the ring has wrapped that is where the next write would have gone
+    uint32_t count = MIN(trace_written, TRACE_ENTRIES);
+    uint32_t first = trace_written > TRACE_ENTRIES ? trace_written % TRACE_ENTRIES : 0;
+    const uint32_t *buffer = trace_buffer();
+
+    // Sized in one pass and sent in a second, the header needs the length
+    TraceEncoder sizer = { false };
+    for (uint32_t i = 0; i < count; i++)
+    {
+        sizer.add(buffer[(first + i) % TRACE_ENTRIES]);
+    }
+    sizer.finish();
+
+    uint32_t header[2] = { sizer.records * (uint32_t)sizeof(uint32_t), trace_written };
+    pl_send_payload(PacketType::TraceData, header, sizeof(header));
+
+    TraceEncoder sender = { true };
+    for (uint32_t i = 0; i < count; i++)
+    {
+        sender.add(buffer[(first + i) % TRACE_ENTRIES]);
+    }
+    sender.finish();
+}
+
+bool coverage_start()
+{
+    if (sm_trace < 0) return false;
+
+    trace_stop();
+
+    memset(coverage_map(), 0, COVERAGE_BLOCKS);
+
+    uint offset = trace_load_program(&coverage_capture_program);
+    pio_sm_config c_sm = coverage_capture_program_get_default_config(offset);
+    sm_config_set_in_pins(&c_sm, COVERAGE_BLOCK_SHIFT);
+    sm_config_set_in_shift(&c_sm, false, false, 32);
+    sm_config_set_out_shift(&c_sm, true, false, 32);
+    pio_sm_init(trace_pio, sm_trace, offset, &c_sm);
+
+    pio_sm_put(trace_pio, sm_trace, (uint32_t)coverage_map() >> 12);
+    pio_sm_exec(trace_pio, sm_trace, pio_encode_pull(false, false));
+    pio_sm_exec(trace_pio, sm_trace, pio_encode_mov(pio_y, pio_osr));
+
+    // Each sampled address is written to the mark channel's write address, the
+    // mark channel then stores a single byte there and chains back for the next one.
+    dma_channel_config c_mark = dma_channel_get_default_config(coverage_mark_chan);
+    channel_config_set_transfer_data_size(&c_mark, DMA_SIZE_8);
+    channel_config_set_read_increment(&c_mark, false);
+    channel_config_set_write_increment(&c_mark, false);
+    channel_config_set_chain_to(&c_mark, coverage_addr_chan);
+    dma_channel_configure(coverage_mark_chan, &c_mark, coverage_map(), &coverage_mark, 1, false);
+
+    dma_channel_config c_addr = dma_channel_get_default_config(coverage_addr_chan);
+    channel_config_set_transfer_data_size(&c_addr, DMA_SIZE_32);
+    channel_config_set_read_increment(&c_addr, false);
+    channel_config_set_write_increment(&c_addr, false);
+    channel_config_set_dreq(&c_addr, pio_get_dreq(trace_pio, sm_trace, false));
+    channel_config_set_chain_to(&c_addr, coverage_mark_chan);
+    dma_channel_configure(coverage_addr_chan, &c_addr, &dma_hw->ch[coverage_mark_chan].write_addr,
+                          &trace_pio->rxf[sm_trace], 1, true);
+
+    pio_sm_set_enabled(trace_pio, sm_trace, true);
+
+    trace_mode = TraceMode::Coverage;
+    trace_written = 0;
+    coverage_valid = true;
+
+    return true;
+}
+
+void coverage_send(bool clear)
+{
+    uint8_t *map = coverage_map();
+
+    pl_send_bulk_header(PacketType::CoverageData, COVERAGE_BLOCKS / 8);
+
+    uint8_t batch[64];
+    for (uint32_t block = 0; block < COVERAGE_BLOCKS; block += sizeof(batch) * 8)
+    {
+        memset(batch, 0, sizeof(batch));
+        for (uint32_t i = 0; coverage_valid && i < sizeof(batch) * 8; i++)
+        {
+            if (map[block + i]) batch[i / 8] |= 1 << (i % 8);
+        }
+        pl_send_raw(batch, sizeof(batch));
+    }
+
+    // A block marked while this runs may be lost, the target is not paused
+    if (clear && coverage_valid) memset(map, 0, COVERAGE_BLOCKS);
+}
@@ -0,0 +1,39 @@
+#if !defined(TRACE_H)
+#define TRACE_H 1
+
+#include <stdint.h>
+
+#include "system.h"
+
+// Addresses are captured into a ring at the top of block ram so only images
+// that end below it can be traced.
+static constexpr uint32_t TRACE_BUFFER_SIZE = 0x8000; // largest dma ring
+static constexpr uint32_t TRACE_BUFFER_OFFSET = ROM_SIZE - TRACE_BUFFER_SIZE;
+
+// Coverage shares the state machine and the buffer with the trace, one byte
+// per block is marked by dma so only one of the two can run at a time.
+static constexpr uint32_t COVERAGE_BLOCK_SHIFT = 6;
+static constexpr uint32_t COVERAGE_BLOCKS = ROM_SIZE >> COVERAGE_BLOCK_SHIFT;
+static constexpr uint32_t COVERAGE_MAP_OFFSET = TRACE_BUFFER_OFFSET;
+
+void trace_init();
+
+// Start recording the address of every access, discarding any previous trace.
+// Fails if there was no state machine left for it (DMA_ROM_SERVICE uses the last one).
+bool trace_start();
+
+// Stop whichever of the trace or coverage is running
+void trace_stop();
+
+// Stop tracing and send what was recorded as TraceData. Runs of sequential
+// addresses are sent as a single record, address | (length - 1) << 18.
+void trace_send();
+
+// Start marking every block the target reads from, clearing the map first
+bool coverage_start();
+
+// Send the map as CoverageData, packed to one bit per block with block n
+// in bit n % 8 of byte n / 8. Coverage keeps running.
+void coverage_send(bool clear);
+
+#endif // TRACE_H
@@ -0,0 +1,156 @@
+#include "pico/stdlib.h"
+#include "hardware/irq.h"
+#include "hardware/pio.h"
+
+#include "system.h"
+#include "trigger.h"
+#include "pico_link.h"
+
+#include "comms.pio.h"
+
+static PIO trigger_pio = pio1;
+
+// pio1 state machines 0 and 1 belong to comms
+static constexpr uint TRIGGER_BASE_SM = 2;
+
+static uint offset_trigger = 0;
+static uint8_t *trigger_rom = nullptr;
+static uint32_t trigger_base = 0;
+static TriggerConfig triggers[N_TRIGGERS];
+static uint32_t trigger_hits[N_TRIGGERS];
+
+// Filled by the interrupt handler, emptied by trigger_update
+static constexpr uint32_t N_PENDING_HITS = 8;
+static TriggerHit pending_hits[N_PENDING_HITS];
+static volatile uint32_t pending_head = 0;
+static uint32_t pending_tail = 0;
+
+static pio_interrupt_source trigger_irq_source(uint index)
+{
+    return (pio_interrupt_source)(pis_sm0_rx_fifo_not_empty + TRIGGER_BASE_SM + index);
+}
+
+static void trigger_irq_handler()
+{
+    uint32_t now = time_us_32();
+
+    for (uint index = 0; index < N_TRIGGERS; index++)
+    {
+        uint sm = TRIGGER_BASE_SM + index;
+        if (pio_sm_is_rx_fifo_empty(trigger_pio, sm)) continue;
+
+        // One entry per access, several may have queued up behind a higher priority interrupt
+        uint level = pio_sm_get_rx_fifo_level(trigger_pio, sm);
+        for (uint i = 0; i < level; i++)
+        {
+            pio_sm_get(trigger_pio, sm);
+        }
+
+        const TriggerConfig &config = triggers[index];
+        if (config.substitute)
+        {
+            trigger_rom[(config.substitute_addr | trigger_base) & ADDR_MASK] = config.substitute_value;
+        }
+
+        trigger_hits[index] += level;
+
+        uint32_t head = pending_head;
+        if (head - pending_tail < N_PENDING_HITS)
+        {
+            pending_hits[head % N_PENDING_HITS] = { now, trigger_hits[index], index };
+            pending_head = head + 1;
+        }
+    }
+}
+
+static void trigger_arm(uint index)
+{
+    uint sm = TRIGGER_BASE_SM + index;
+    const TriggerConfig &config = triggers[index];
+
+    pio_set_irq0_source_enabled(trigger_pio, trigger_irq_source(index), false);
+    pio_sm_set_enabled(trigger_pio, sm, false);
+
+    if (!config.enabled) return;
+
+    pio_sm_config c = address_trigger_program_get_default_config(offset_trigger);
+    sm_config_set_in_pins(&c, 0);
+    pio_sm_init(trigger_pio, sm, offset_trigger, &c);
+
+    // a18, buf_oe, oe and ce are all low during a read
+    pio_sm_put(trigger_pio, sm, (config.addr | trigger_base) & ADDR_MASK);
+    pio_sm_exec(trigger_pio, sm, pio_encode_pull(false, false));
+    pio_sm_exec(trigger_pio, sm, pio_encode_mov(pio_y, pio_osr));
+
+    pio_set_irq0_source_enabled(trigger_pio, trigger_irq_source(index), true);
+    pio_sm_set_enabled(trigger_pio, sm, true);
+}
+
+void trigger_init(uint8_t *rom_base)
+{
+    trigger_rom = rom_base;
+    offset_trigger = pio_add_program(trigger_pio, &address_trigger_program);
+
+    irq_add_shared_handler(PIO1_IRQ_0, trigger_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(PIO1_IRQ_0, true);
+}
+
+bool trigger_set(const TriggerConfig &config, uint32_t image_base)
+{
+    if (config.index >= N_TRIGGERS) return false;
+
+    trigger_base = image_base;
+    triggers[config.index] = config;
+    trigger_hits[config.index] = 0;
+    trigger_arm(config.index);
+
+    return true;
+}
+
+void trigger_set_base(uint32_t image_base)
+{
+    trigger_base = image_base;
+    for (uint index = 0; index < N_TRIGGERS; index++)
+    {
+        trigger_arm(index);
+    }
+}
+
+void trigger_reset()
+{
+    for (uint index = 0; index < N_TRIGGERS; index++)
+    {
+        triggers[index].enabled = 0;
+        trigger_arm(index);
+    }
+    pending_tail = pending_head;
+}
+
+void trigger_suspend()
+{
+    for (uint index = 0; index < N_TRIGGERS; index++)
+    {
+        pio_set_irq0_source_enabled(trigger_pio, trigger_irq_source(index), false);
+        pio_sm_set_enabled(trigger_pio, TRIGGER_BASE_SM + index, false);
+    }
+}
+
+void trigger_resume()
+{
+    offset_trigger = pio_add_program(trigger_pio, &address_trigger_program);
+    trigger_set_base(trigger_base);
+}
+
+bool trigger_idle()
+{
+    return pending_tail == pending_head;
+}
+
+void trigger_update()
+{
+    while (pending_tail != pending_head)
+    {
+        pl_send_payload(PacketType::TriggerHit, &pending_hits[pending_tail % N_PENDING_HITS], sizeof(TriggerHit));
+        pending_tail++;
+    }
+}
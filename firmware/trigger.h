@@ -0,0 +1,49 @@
+#if !defined(TRIGGER_H)
+#define TRIGGER_H 1
+
+#include <stdint.h>
+
+// Address triggers run on pio1 state machines 2 and 3, alongside comms
+static constexpr uint32_t N_TRIGGERS = 2;
+
+struct TriggerConfig
+{
+    uint32_t addr; // relative to the image being served
+    uint32_t substitute_addr;
+    uint8_t index;
+    uint8_t enabled;
+    uint8_t substitute; // write substitute_value to substitute_addr on every hit
+    uint8_t substitute_value;
+};
+
+static_assert(sizeof(TriggerConfig) == 12);
+
+// Sent as TriggerHit, count includes any hits that were not reported
+struct TriggerHit
+{
+    uint32_t time_us;
+    uint32_t count;
+    uint32_t index;
+};
+
+void trigger_init(uint8_t *rom_base);
+
+// Set or disable a trigger, false if the index is out of range
+bool trigger_set(const TriggerConfig &config, uint32_t image_base);
+
+// Disable every trigger and drop any unsent hits
+void trigger_reset();
+
+// Follow the image when it is swapped
+void trigger_set_base(uint32_t image_base);
+
+// Stop every trigger while something else needs pio1 to itself, resume
+// reloads the program and rearms them.
+void trigger_suspend();
+void trigger_resume();
+
+// Send any hits since the last update
+void trigger_update();
+bool trigger_idle();
+
+#endif // TRIGGER_H
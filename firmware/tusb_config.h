@@ -0,0 +1,19 @@
+#if !defined(TUSB_CONFIG_H)
+#define TUSB_CONFIG_H 1
+
+#define CFG_TUSB_RHPORT0_MODE (OPT_MODE_DEVICE)
+
+#define CFG_TUD_ENDPOINT0_SIZE 64
+
+#define CFG_TUD_CDC 1
+#define CFG_TUD_CDC_RX_BUFSIZE 256
+#define CFG_TUD_CDC_TX_BUFSIZE 256
+
+// Raw bulk endpoints for hosts that can talk to the device directly instead of
+// going through the OS serial stack.
+#define CFG_TUD_VENDOR 1
+#define CFG_TUD_VENDOR_EPSIZE 64
+#define CFG_TUD_VENDOR_RX_BUFSIZE 256
+#define CFG_TUD_VENDOR_TX_BUFSIZE 256
+
+#endif // TUSB_CONFIG_H
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "pico/unique_id.h"
+
+#include <tusb.h>
+
+#include "usb_descriptors.h"
+
+static constexpr uint16_t USBD_VID = 0x2e8a; // Raspberry Pi
+static constexpr uint16_t USBD_PID = 0x000a; // Raspberry Pi Pico SDK CDC
+
+static constexpr uint8_t USBD_CDC_EP_CMD = 0x81;
+static constexpr uint8_t USBD_CDC_EP_OUT = 0x02;
+static constexpr uint8_t USBD_CDC_EP_IN = 0x82;
+static constexpr uint8_t USBD_CDC_CMD_MAX_SIZE = 8;
+static constexpr uint8_t USBD_CDC_IN_OUT_MAX_SIZE = 64;
+
+static constexpr uint8_t USBD_VENDOR_EP_OUT = 0x03;
+static constexpr uint8_t USBD_VENDOR_EP_IN = 0x83;
+
+static constexpr uint16_t USBD_MAX_POWER_MA = 250;
+
+static constexpr uint16_t USBD_DESC_LEN = TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN;
+
+enum
+{
+    USBD_STR_LANGID = 0,
+    USBD_STR_MANUF,
+    USBD_STR_PRODUCT,
+    USBD_STR_SERIAL,
+    USBD_STR_CDC,
+    USBD_STR_VENDOR,
+    USBD_STR_COUNT
+};
+
+static const tusb_desc_device_t usbd_desc_device = {
+    .bLength = sizeof(tusb_desc_device_t),
+    .bDescriptorType = TUSB_DESC_DEVICE,
+    .bcdUSB = 0x0210, // 2.1 for the BOS descriptor
+    .bDeviceClass = TUSB_CLASS_MISC,
+    .bDeviceSubClass = MISC_SUBCLASS_COMMON,
+    .bDeviceProtocol = MISC_PROTOCOL_IAD,
+    .bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+    .idVendor = USBD_VID,
+    .idProduct = USBD_PID,
+    .bcdDevice = 0x0100,
+    .iManufacturer = USBD_STR_MANUF,
+    .iProduct = USBD_STR_PRODUCT,
+    .iSerialNumber = USBD_STR_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
+    TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, USBD_STR_LANGID, USBD_DESC_LEN, 0, USBD_MAX_POWER_MA),
+
+    TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, USBD_STR_CDC, USBD_CDC_EP_CMD, USBD_CDC_CMD_MAX_SIZE,
+                       USBD_CDC_EP_OUT, USBD_CDC_EP_IN, USBD_CDC_IN_OUT_MAX_SIZE),
+
+    TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, USBD_STR_VENDOR, USBD_VENDOR_EP_OUT, USBD_VENDOR_EP_IN,
+                          CFG_TUD_VENDOR_EPSIZE),
+};
+
+static constexpr uint16_t MS_OS_20_DESC_LEN = 0xb2;
+static constexpr uint16_t BOS_TOTAL_LEN = TUD_BOS_DESC_LEN + TUD_BOS_MICROSOFT_OS_DESC_LEN;
+
+static const uint8_t usbd_desc_bos[] = {
+    TUD_BOS_DESCRIPTOR(BOS_TOTAL_LEN, 1),
+    TUD_BOS_MS_OS_20_DESCRIPTOR(MS_OS_20_DESC_LEN, VENDOR_REQUEST_MICROSOFT),
+};
+
+// Marks the bulk interface as WinUSB compatible so no driver install is needed on Windows
+static const uint8_t usbd_desc_ms_os_20[MS_OS_20_DESC_LEN] = {
+    // Set header: length, type, windows version, total length
+    U16_TO_U8S_LE(0x000a), U16_TO_U8S_LE(MS_OS_20_SET_HEADER_DESCRIPTOR), U32_TO_U8S_LE(0x06030000),
+    U16_TO_U8S_LE(MS_OS_20_DESC_LEN),
+
+    // Configuration subset header: length, type, configuration index, reserved, configuration total length
+    U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_CONFIGURATION), 0, 0,
+    U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0a),
+
+    // Function subset header: length, type, first interface, reserved, subset length
+    U16_TO_U8S_LE(0x0008), U16_TO_U8S_LE(MS_OS_20_SUBSET_HEADER_FUNCTION), ITF_NUM_VENDOR, 0,
+    U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0a - 0x08),
+
+    // Compatible ID: length, type, compatible ID, sub compatible ID
+    U16_TO_U8S_LE(0x0014), U16_TO_U8S_LE(MS_OS_20_FEATURE_COMPATBLE_ID),
+    'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+
+    // Registry property: length, type, data type, name length, name, data length, data
+    U16_TO_U8S_LE(MS_OS_20_DESC_LEN - 0x0a - 0x08 - 0x08 - 0x14), U16_TO_U8S_LE(MS_OS_20_FEATURE_REG_PROPERTY),
+    U16_TO_U8S_LE(0x0007), U16_TO_U8S_LE(0x002a),
+    'D', 0, 'e', 0, 'v', 0, 'i', 0, 'c', 0, 'e', 0, 'I', 0, 'n', 0, 't', 0, 'e', 0, 'r', 0,
+    'f', 0, 'a', 0, 'c', 0, 'e', 0, 'G', 0, 'U', 0, 'I', 0, 'D', 0, 's', 0, 0, 0,
+    U16_TO_U8S_LE(0x0050),
+    '{', 0, '6', 0, 'B', 0, '3', 0, 'D', 0, '0', 0, 'C', 0, '2', 0, 'E', 0, '-', 0,
+    '5', 0, '8', 0, 'A', 0, '1', 0, '-', 0, '4', 0, 'F', 0, '7', 0, 'E', 0, '-', 0,
+    '9', 0, 'C', 0, '2', 0, 'B', 0, '-', 0, '3', 0, 'E', 0, '1', 0, 'D', 0, '7', 0,
+    'A', 0, '4', 0, 'F', 0, '6', 0, 'C', 0, '0', 0, '9', 0, '}', 0, 0, 0, 0, 0,
+};
+
+static_assert(sizeof(usbd_desc_ms_os_20) == MS_OS_20_DESC_LEN);
+
+static const char *const usbd_desc_str[USBD_STR_COUNT] = {
+    nullptr,
+    "Raspberry Pi",
+    "PicoROM",
+    nullptr, // board id
+    "PicoROM CDC",
+    "PicoROM Bulk",
+};
+
+// The board name, so hosts can find a device by name without opening it
+static constexpr size_t SERIAL_MAX = 32;
+static char usb_serial[SERIAL_MAX + 1];
+
+bool usb_set_serial(const char *serial)
+{
+    if (!strncmp(usb_serial, serial, SERIAL_MAX)) return false;
+
+    strncpy(usb_serial, serial, SERIAL_MAX);
+    usb_serial[SERIAL_MAX] = '\0';
+    return true;
+}
+
+const uint8_t *usb_ms_os_20_descriptor(uint16_t *len)
+{
+    *len = sizeof(usbd_desc_ms_os_20);
+    return usbd_desc_ms_os_20;
+}
+
+const uint8_t *tud_descriptor_device_cb()
+{
+    return (const uint8_t *)&usbd_desc_device;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t /*index*/)
+{
+    return usbd_desc_cfg;
+}
+
+const uint8_t *tud_descriptor_bos_cb()
+{
+    return usbd_desc_bos;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t /*langid*/)
+{
+    static constexpr size_t DESC_STR_MAX = 32;
+    static uint16_t desc_str[DESC_STR_MAX + 1];
+    static char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+
+    size_t len;
+    if (index == USBD_STR_LANGID)
+    {
+        desc_str[1] = 0x0409; // English
+        len = 1;
+    }
+    else
+    {
+        if (index >= USBD_STR_COUNT) return nullptr;
+
+        const char *str = usbd_desc_str[index];
+        if (index == USBD_STR_SERIAL && usb_serial[0])
+        {
+            str = usb_serial;
+        }
+        else if (index == USBD_STR_SERIAL)
+        {
+            pico_get_unique_board_id_string(serial, sizeof(serial));
+            str = serial;
+        }
+
+        len = MIN(strlen(str), DESC_STR_MAX);
+        for (size_t i = 0; i < len; i++)
+        {
+            desc_str[1 + i] = str[i];
+        }
+    }
+
+    // first word is the length in bytes and the descriptor type
+    desc_str[0] = (uint16_t)((TUSB_DESC_STRING << 8) | (2 * len + 2));
+
+    return desc_str;
+}
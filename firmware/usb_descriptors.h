@@ -0,0 +1,28 @@
+#if !defined(USB_DESCRIPTORS_H)
+#define USB_DESCRIPTORS_H 1
+
+#include <stdint.h>
+
+enum
+{
+    ITF_NUM_CDC = 0,
+    ITF_NUM_CDC_DATA,
+    ITF_NUM_VENDOR,
+    ITF_NUM_TOTAL
+};
+
+// bRequest values for vendor control transfers
+enum
+{
+    VENDOR_REQUEST_MICROSOFT = 1, // MS OS 2.0 descriptor set, lets Windows bind WinUSB
+    VENDOR_REQUEST_CONNECT = 2,   // wValue 1 opens a session on the bulk interface, 0 closes it
+};
+
+const uint8_t *usb_ms_os_20_descriptor(uint16_t *len);
+
+// Set the serial number string, the unique board id is used until it is set
+// to something non-empty. Returns true if it changed, the host only sees the
+// new one once the device enumerates again.
+bool usb_set_serial(const char *serial);
+
+#endif // USB_DESCRIPTORS_H
@@ -1,11 +1,17 @@
 use anyhow::{anyhow, Result};
-use serialport::SerialPort;
-use std::collections::HashMap;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{mpsc, Arc, Mutex};
+use std::thread::JoinHandle;
 use std::{thread::sleep, time::Duration, time::Instant};
 
 use num_derive::FromPrimitive;
 use num_traits::FromPrimitive;
 
+mod rle;
+mod transport;
+use transport::*;
+
 #[repr(u8)]
 #[derive(FromPrimitive, Debug)]
 enum PacketKind {
@@ -27,15 +33,220 @@ enum PacketKind {
     CommitFlash = 12,
     CommitDone = 13,
 
+    WriteBulk = 14,
+    WriteAck = 15,
+    WriteError = 16,
+    Checksum = 17,
+    ChecksumResult = 18,
+    ReadBulk = 19,
+    ReadBulkData = 20,
+    BlockChecksums = 21,
+    BlockChecksumsData = 22,
+
+    ImageGet = 23,
+    ImageCur = 24,
+    ImageSwap = 25,
+
+    SlotCommit = 26,
+    SlotLoad = 27,
+    SlotLoaded = 28,
+
+    LatencyTest = 29,
+    LatencyResult = 30,
+
+    ClockSet = 31,
+    ClockGet = 32,
+    ClockCur = 33,
+
+    TraceStart = 34,
+    TraceRead = 35,
+    TraceData = 36,
+
+    CoverageStart = 37,
+    CoverageRead = 38,
+    CoverageData = 39,
+
+    TriggerSet = 40,
+    TriggerHit = 41,
+
+    BootTimeGet = 42,
+    BootTime = 43,
+
+    WriteCompressed = 44,
+
+    Fill = 45,
+    Copy = 46,
+
+    StatsGet = 47,
+    StatsData = 48,
+
+    Done = 49,
+
     CommsStart = 80,
     CommsEnd = 81,
     CommsData = 82,
+    CommsCredit = 83,
 
     Identify = 0xf8,
     Error = 0xfe,
     Debug = 0xff,
 }
 
+/// Memory a checksum is calculated over
+#[repr(u8)]
+#[derive(Clone, Copy, Debug)]
+pub enum ChecksumSource {
+    /// The image currently being served
+    Ram = 0,
+    /// The image committed to flash
+    Flash = 1,
+}
+
+/// System clock settings, persisted by the PicoROM
+#[repr(u8)]
+#[derive(Clone, Copy, Debug, PartialEq, FromPrimitive)]
+pub enum ClockProfile {
+    /// 160MHz
+    Standard = 0,
+    /// 100MHz at a reduced core voltage
+    Low = 1,
+    /// 200MHz
+    Fast = 2,
+    /// 250MHz
+    Fastest = 3,
+}
+
+/// Which bytes of a 16-bit image a PicoROM serves when two are used together
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum ByteLane {
+    /// Bytes at even offsets in the image
+    Even = 1,
+    /// Bytes at odd offsets in the image
+    Odd = 2,
+}
+
+impl ByteLane {
+    /// The bytes of an interleaved image that belong to this lane
+    pub fn extract(&self, data: &[u8]) -> Vec<u8> {
+        let first = *self as usize - 1;
+        data.iter().skip(first).step_by(2).cloned().collect()
+    }
+}
+
+/// Number of address triggers a PicoROM has
+pub const N_TRIGGERS: u8 = 2;
+
+/// An address trigger, it fires on every read of addr
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct Trigger {
+    pub addr: u32,
+    /// Address and value to write into the image whenever the trigger fires
+    pub substitute: Option<(u32, u8)>,
+}
+
+/// A report of a trigger firing
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct TriggerHit {
+    pub index: u8,
+    /// Time of the hit in microseconds, from the PicoROM's own free running clock
+    pub time_us: u32,
+    /// Number of hits since the trigger was set, including any that were not reported
+    pub count: u32,
+}
+
+/// Counters kept by the PicoROM since it booted, they wrap
+#[derive(Clone, Copy, Debug, Default)]
+pub struct Stats {
+    pub uptime_ms: u32,
+    /// Packets handled
+    pub packets: u32,
+    /// Raw bytes received after bulk headers
+    pub bulk_bytes: u32,
+    /// Writes to the host that had to wait for room in the USB buffer
+    pub usb_write_retries: u32,
+    /// Comms bytes from the target to the host
+    pub comms_out_bytes: u32,
+    /// Comms bytes from the host to the target
+    pub comms_in_bytes: u32,
+    /// Target comms writes held off because the PicoROM's buffer was full
+    pub comms_out_stalls: u32,
+    /// Times host comms data was dropped because the target stopped reading
+    pub comms_timeouts: u32,
+    /// Activity LED polls, roughly every 10ms, that saw the target reading the ROM.
+    /// This is not a count of reads, and stays 0 on firmware built without ACTIVITY_LED.
+    pub rom_active_polls: u32,
+}
+
+impl Stats {
+    fn decode(data: &[u8]) -> Result<Stats> {
+        let mut fields = data
+            .chunks_exact(4)
+            .map(|x| u32::from_le_bytes(x.try_into().unwrap()));
+        let mut next = || {
+            fields
+                .next()
+                .ok_or_else(|| anyhow!("Stats are too small: {}", data.len()))
+        };
+
+        Ok(Stats {
+            uptime_ms: next()?,
+            packets: next()?,
+            bulk_bytes: next()?,
+            usb_write_retries: next()?,
+            comms_out_bytes: next()?,
+            comms_in_bytes: next()?,
+            comms_out_stalls: next()?,
+            comms_timeouts: next()?,
+            rom_active_polls: next()?,
+        })
+    }
+}
+
+/// A run of sequential accesses in a trace
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct TraceRun {
+    pub addr: u32,
+    pub len: u32,
+}
+
+/// Distribution of one latency measurement, in system clock cycles
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LatencyStats {
+    pub min: u16,
+    pub avg: u16,
+    pub max: u16,
+    /// Probes where the data never changed
+    pub timeouts: u16,
+}
+
+impl LatencyStats {
+    fn decode(data: &[u8]) -> LatencyStats {
+        let field = |i: usize| u16::from_le_bytes([data[i * 2], data[i * 2 + 1]]);
+        LatencyStats {
+            min: field(0),
+            avg: field(1),
+            max: field(2),
+            timeouts: field(3),
+        }
+    }
+}
+
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LatencyReport {
+    pub sys_khz: u32,
+    /// Address change to data change
+    pub addr: LatencyStats,
+    /// OE/CE asserted to data driven
+    pub oe: LatencyStats,
+}
+
+impl LatencyReport {
+    /// Convert a number of cycles to nanoseconds
+    pub fn ns(&self, cycles: u16) -> f32 {
+        cycles as f32 * 1_000_000.0 / self.sys_khz as f32
+    }
+}
+
 #[derive(Clone, Debug)]
 pub enum ReqPacket {
     Ident,
@@ -45,16 +256,57 @@ pub enum ReqPacket {
     MaskSet(u32),
     MaskGet,
     Write(Vec<u8>),
+    /// Sequence number (0 for unsequenced) and data
+    WriteBulk(u32, Vec<u8>),
+    /// The same, but the PicoROM only keeps the bytes in its lane
+    WriteBulkLane(u32, ByteLane, Vec<u8>),
+    /// Sequenced bulk write of run length encoded data and its decoded length
+    WriteCompressed(u32, u32, Vec<u8>),
     Read,
+    /// Read this many bytes from the pointer in a single response
+    ReadBulk(u32),
+    /// CRC32 of a range of memory
+    Checksum(u32, u32, ChecksumSource),
+    /// CRC32 of each of a run of blocks: offset, block size and block count
+    BlockChecksums(u32, u32, u32),
+    /// Serve the other half of the ROM buffer
+    ImageSwap,
+    ImageGet,
     CommitFlash,
-    CommsStart(u32),
+    /// Commit the ROM image to a flash slot
+    SlotCommit(u8),
+    /// Load a flash slot, optionally making it the one loaded at boot
+    SlotLoad(u8, bool),
+    /// Start comms with the registers at addr, in block mode if set
+    CommsStart(u32, bool),
     CommsEnd,
     CommsData(Vec<u8>),
     Identify,
+    /// Fill length bytes at offset with a value
+    Fill(u32, u32, u8),
+    /// Copy length bytes from the first offset to the second, the destination can't start inside the source
+    Copy(u32, u32, u32),
+    /// Run the latency self test with this many samples
+    LatencyTest(u16),
+    ClockSet(ClockProfile),
+    ClockGet,
+    TraceStart,
+    /// Stop tracing and read the trace
+    TraceRead,
+    CoverageStart,
+    /// Read the coverage map, clearing it afterwards if set
+    CoverageRead(bool),
+    /// Set or, with None, disable a trigger
+    TriggerSet(u8, Option<Trigger>),
+    BootTimeGet,
+    StatsGet,
 }
 
 impl ReqPacket {
     fn encode(self) -> Result<Vec<u8>> {
+        // Bulk data is sent raw, after the packet header
+        let mut bulk = Vec::new();
+
         let (kind, payload) = match self.clone() {
             ReqPacket::Ident => (PacketKind::IdentReq, vec![]),
             ReqPacket::IdentSet(name) => (PacketKind::IdentSet, name.as_bytes().to_vec()),
@@ -65,22 +317,105 @@ impl ReqPacket {
             ReqPacket::MaskSet(mask) => (PacketKind::MaskSet, mask.to_le_bytes().to_vec()),
             ReqPacket::MaskGet => (PacketKind::MaskGet, vec![]),
             ReqPacket::Write(data) => (PacketKind::Write, data),
+            ReqPacket::WriteBulk(seq, data) => {
+                bulk = data;
+                let mut header = (bulk.len() as u32).to_le_bytes().to_vec();
+                header.extend_from_slice(&seq.to_le_bytes());
+                (PacketKind::WriteBulk, header)
+            }
+            ReqPacket::WriteBulkLane(seq, lane, data) => {
+                bulk = data;
+                let mut header = (bulk.len() as u32).to_le_bytes().to_vec();
+                header.extend_from_slice(&seq.to_le_bytes());
+                header.push(lane as u8);
+                (PacketKind::WriteBulk, header)
+            }
+            ReqPacket::WriteCompressed(seq, decoded_len, data) => {
+                bulk = data;
+                let mut header = (bulk.len() as u32).to_le_bytes().to_vec();
+                header.extend_from_slice(&seq.to_le_bytes());
+                header.extend_from_slice(&decoded_len.to_le_bytes());
+                (PacketKind::WriteCompressed, header)
+            }
             ReqPacket::Read => (PacketKind::Read, vec![]),
+            ReqPacket::ReadBulk(len) => (PacketKind::ReadBulk, len.to_le_bytes().to_vec()),
+            ReqPacket::Checksum(offset, len, source) => {
+                let mut payload = offset.to_le_bytes().to_vec();
+                payload.extend_from_slice(&len.to_le_bytes());
+                payload.push(source as u8);
+                (PacketKind::Checksum, payload)
+            }
+            ReqPacket::BlockChecksums(offset, block_size, count) => {
+                let mut payload = offset.to_le_bytes().to_vec();
+                payload.extend_from_slice(&block_size.to_le_bytes());
+                payload.extend_from_slice(&count.to_le_bytes());
+                (PacketKind::BlockChecksums, payload)
+            }
+            ReqPacket::ImageSwap => (PacketKind::ImageSwap, vec![]),
+            ReqPacket::ImageGet => (PacketKind::ImageGet, vec![]),
             ReqPacket::CommitFlash => (PacketKind::CommitFlash, vec![]),
-            ReqPacket::CommsStart(addr) => (PacketKind::CommsStart, addr.to_le_bytes().to_vec()),
+            ReqPacket::SlotCommit(slot) => (PacketKind::SlotCommit, vec![slot]),
+            ReqPacket::SlotLoad(slot, boot) => (PacketKind::SlotLoad, vec![slot, boot as u8]),
+            ReqPacket::CommsStart(addr, block) => {
+                let mut payload = addr.to_le_bytes().to_vec();
+                payload.push(block as u8);
+                (PacketKind::CommsStart, payload)
+            }
             ReqPacket::CommsEnd => (PacketKind::CommsEnd, vec![]),
             ReqPacket::CommsData(data) => (PacketKind::CommsData, data),
             ReqPacket::Identify => (PacketKind::Identify, vec![]),
+            ReqPacket::Fill(offset, len, value) => {
+                let mut payload = offset.to_le_bytes().to_vec();
+                payload.extend_from_slice(&len.to_le_bytes());
+                payload.push(value);
+                (PacketKind::Fill, payload)
+            }
+            ReqPacket::Copy(src, dest, len) => {
+                let mut payload = src.to_le_bytes().to_vec();
+                payload.extend_from_slice(&dest.to_le_bytes());
+                payload.extend_from_slice(&len.to_le_bytes());
+                (PacketKind::Copy, payload)
+            }
+            ReqPacket::ClockSet(profile) => (
+                PacketKind::ClockSet,
+                (profile as u32).to_le_bytes().to_vec(),
+            ),
+            ReqPacket::ClockGet => (PacketKind::ClockGet, vec![]),
+            ReqPacket::BootTimeGet => (PacketKind::BootTimeGet, vec![]),
+            ReqPacket::StatsGet => (PacketKind::StatsGet, vec![]),
+            ReqPacket::TraceStart => (PacketKind::TraceStart, vec![]),
+            ReqPacket::TraceRead => (PacketKind::TraceRead, vec![]),
+            ReqPacket::CoverageStart => (PacketKind::CoverageStart, vec![]),
+            ReqPacket::CoverageRead(clear) => (PacketKind::CoverageRead, vec![clear as u8]),
+            ReqPacket::TriggerSet(index, trigger) => {
+                let enabled = trigger.is_some();
+                let trigger = trigger.unwrap_or_default();
+                let (sub_addr, sub_value) = trigger.substitute.unwrap_or_default();
+                let mut payload = Vec::new();
+                payload.extend_from_slice(&trigger.addr.to_le_bytes());
+                payload.extend_from_slice(&sub_addr.to_le_bytes());
+                payload.extend_from_slice(&[
+                    index,
+                    enabled as u8,
+                    trigger.substitute.is_some() as u8,
+                    sub_value,
+                ]);
+                (PacketKind::TriggerSet, payload)
+            }
+            ReqPacket::LatencyTest(samples) => {
+                (PacketKind::LatencyTest, samples.to_le_bytes().to_vec())
+            }
         };
 
         if payload.len() > 30 {
             return Err(anyhow!("{:?} request packet payload too large", self));
         }
 
-        let mut data = Vec::with_capacity(32);
+        let mut data = Vec::with_capacity(32 + bulk.len());
         data.push(kind as u8);
         data.push(payload.len() as u8);
         data.extend(payload);
+        data.extend(bulk);
         Ok(data)
     }
 }
@@ -90,16 +425,127 @@ pub enum RespPacket {
     Ident(String),
     PointerCur(u32),
     ReadData(Vec<u8>),
+    ReadBulkData(Vec<u8>),
+    Checksum(u32),
+    BlockChecksums(Vec<u32>),
+    /// Offset of the image being served
+    ImageCur(u32),
+    /// CRC32 of the loaded image and of the image when it was committed
+    SlotLoaded(u32, u32),
+    LatencyResult(LatencyReport),
+    /// Profile and actual system clock in kHz
+    ClockCur(u32, u32),
+    /// Total number of accesses, including any that no longer fit, and the recorded runs
+    TraceData(u32, Vec<TraceRun>),
+    /// One bit per COVERAGE_BLOCK_SIZE bytes, lowest bit first
+    CoverageData(Vec<u8>),
+    TriggerHit(TriggerHit),
+    /// Microseconds from reset until the ROM was being served and until the whole image was loaded
+    BootTime(u32, u32),
+    Stats(Stats),
     CommitDone,
+    /// Acknowledges a request that has no reply of its own
+    Done,
     CommsData(Vec<u8>),
+    /// Number of bytes of comms data the host may send on top of its current credit
+    CommsCredit(u32),
+    /// All sequenced writes up to and including this one have landed
+    WriteAck(u32),
+    /// Sequence number, offset and size of a write that was rejected
+    WriteError(u32, u32, u32),
 
     Error(String, u32, u32),
     Debug(String, u32, u32),
 }
 
+/// Size of each bulk write used when uploading
+const BULK_CHUNK_SIZE: usize = 4096;
+
+/// Number of bulk writes that can be in flight before waiting for an acknowledgement
+const WRITE_WINDOW: usize = 8;
+
+/// The PicoROM drops comms data the target hasn't read for this long, so no credit comes back
+const COMMS_SEND_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Images up to this size can be staged in one half of the ROM buffer while the other is served
+pub const IMAGE_SLOT_SIZE: usize = 0x20000;
+
+/// Granularity of the coverage map
+pub const COVERAGE_BLOCK_SIZE: u32 = 64;
+
+/// Padding at the end of an image shorter than this is sent rather than filled
+const MIN_FILL_SIZE: usize = 64;
+
+/// Granularity of the comparison done by a delta upload
+const DELTA_BLOCK_SIZE: usize = 4096;
+
 pub struct PicoLink {
-    port: Box<dyn SerialPort>,
+    /// Set once incoming data is read on a thread of its own. Dropped before
+    /// the port so the thread has stopped reading before it closes.
+    reader: Option<BackgroundReader>,
+    port: Box<dyn Transport>,
     debug: bool,
+    /// Hits arrive whenever a trigger fires so they are kept here whatever else is being waited for
+    trigger_hits: VecDeque<TriggerHit>,
+    /// Bytes of comms data the PicoROM has room for, it is returned as the target reads
+    comms_credit: usize,
+    /// Received data that hasn't been parsed yet, from rx_pos on
+    rx: Vec<u8>,
+    rx_pos: usize,
+}
+
+/// Size of each read from the transport, many packets are parsed from one read
+const RECV_READ_SIZE: usize = 4096;
+
+/// Once a packet has started the rest of it should not take longer than this
+const RECV_TIMEOUT: Duration = Duration::from_millis(1000);
+
+/// How often the background reader checks whether it should stop
+const READER_POLL: Duration = Duration::from_millis(10);
+
+/// Reads the transport on its own thread, passing on whatever arrives
+struct BackgroundReader {
+    chunks: mpsc::Receiver<Result<Vec<u8>, String>>,
+    stop: Arc<AtomicBool>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl BackgroundReader {
+    fn start(mut port: Box<dyn TransportReader>) -> BackgroundReader {
+        let (tx, chunks) = mpsc::channel();
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread_stop = stop.clone();
+
+        let thread = std::thread::spawn(move || {
+            let mut buf = vec![0u8; RECV_READ_SIZE];
+            while !thread_stop.load(Ordering::Relaxed) {
+                let chunk = match port.read(&mut buf, READER_POLL) {
+                    Ok(0) => continue,
+                    Ok(count) => Ok(buf[..count].to_vec()),
+                    Err(e) => Err(e.to_string()),
+                };
+                let failed = chunk.is_err();
+                if tx.send(chunk).is_err() || failed {
+                    break;
+                }
+            }
+        });
+
+        BackgroundReader {
+            chunks,
+            stop,
+            thread: Some(thread),
+        }
+    }
+}
+
+impl Drop for BackgroundReader {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
 }
 
 struct RawPacket {
@@ -110,25 +556,99 @@ struct RawPacket {
 
 impl PicoLink {
     pub fn open(port_path: &str, debug: bool) -> Result<PicoLink> {
-        let mut port = serialport::new(port_path, 9600)
-            .timeout(std::time::Duration::from_millis(1000))
-            .open()?;
+        let port = SerialTransport::open(port_path)?;
+        PicoLink::connect(Box::new(port), debug)
+    }
+
+    /// Open a PicoROM through its vendor bulk interface, bypassing the OS serial stack
+    #[cfg(feature = "usb-bulk")]
+    pub fn open_usb(serial_number: &str, debug: bool) -> Result<PicoLink> {
+        let port = UsbTransport::open(serial_number)?;
+        PicoLink::connect(Box::new(port), debug)
+    }
+
+    fn connect(port: Box<dyn Transport>, debug: bool) -> Result<PicoLink> {
+        let mut link = PicoLink {
+            reader: None,
+            port: port,
+            debug: debug,
+            trigger_hits: VecDeque::new(),
+            comms_credit: 0,
+            rx: Vec::new(),
+            rx_pos: 0,
+        };
+
+        let mut preamble = [0u8; 13];
+        link.read_exact(&mut preamble)?;
 
-        let expected = "PicoROM Hello".as_bytes();
-        let mut preamble = Vec::new();
+        Ok(link)
+    }
 
-        port.write_data_terminal_ready(true)?;
+    /// Read incoming data on a background thread from now on, so it is
+    /// drained continuously even while the caller is busy elsewhere
+    pub fn start_reader(&mut self) -> Result<()> {
+        if self.reader.is_none() {
+            self.reader = Some(BackgroundReader::start(self.port.split_reader()?));
+        }
+        Ok(())
+    }
 
-        while preamble.len() < expected.len() && !preamble.ends_with(&expected) {
-            let mut buf = [0u8];
-            port.read_exact(&mut buf)?;
-            preamble.push(buf[0]);
+    /// Wait for more data until the deadline, returns false if none arrived
+    fn recv_fill(&mut self, deadline: Instant) -> Result<bool> {
+        if self.rx_pos > 0 {
+            self.rx.drain(..self.rx_pos);
+            self.rx_pos = 0;
         }
+        let buffered = self.rx.len();
 
-        Ok(PicoLink {
-            port: port,
-            debug: debug,
-        })
+        let timeout = deadline.saturating_duration_since(Instant::now());
+
+        if let Some(reader) = &self.reader {
+            match reader.chunks.recv_timeout(timeout) {
+                Ok(Ok(chunk)) => self.rx.extend_from_slice(&chunk),
+                Ok(Err(e)) => return Err(anyhow!("{}", e)),
+                Err(mpsc::RecvTimeoutError::Timeout) => {}
+                Err(mpsc::RecvTimeoutError::Disconnected) => {
+                    return Err(anyhow!("Background reader stopped"))
+                }
+            }
+        } else {
+            let start = self.rx.len();
+            self.rx.resize(start + RECV_READ_SIZE, 0);
+            let res = self.port.read(&mut self.rx[start..], timeout);
+            self.rx.truncate(start + *res.as_ref().unwrap_or(&0));
+            res?;
+        }
+
+        Ok(self.rx.len() > buffered || Instant::now() < deadline)
+    }
+
+    fn rx_available(&self) -> usize {
+        self.rx.len() - self.rx_pos
+    }
+
+    fn read_exact(&mut self, buf: &mut [u8]) -> Result<()> {
+        let mut pos = 0;
+        let mut deadline = Instant::now() + RECV_TIMEOUT;
+
+        while pos < buf.len() {
+            if self.rx_available() == 0 {
+                if !self.recv_fill(deadline)? {
+                    return Err(anyhow!("Read timeout"));
+                }
+                if self.rx_available() > 0 {
+                    deadline = Instant::now() + RECV_TIMEOUT;
+                }
+                continue;
+            }
+
+            let count = (buf.len() - pos).min(self.rx_available());
+            buf[pos..pos + count].copy_from_slice(&self.rx[self.rx_pos..self.rx_pos + count]);
+            pos += count;
+            self.rx_pos += count;
+        }
+
+        Ok(())
     }
 
     pub fn send(&mut self, packet: ReqPacket) -> Result<()> {
@@ -142,32 +662,32 @@ impl PicoLink {
         Ok(())
     }
 
+    /// Send a packet without first draining pending responses
+    fn send_posted(&mut self, packet: ReqPacket) -> Result<()> {
+        let data = packet.encode()?;
+        self.port.write_all(&data)?;
+        Ok(())
+    }
+
     /// Receive a raw packet
     /// Err on port error or packet formatting
     /// None if data not received before deadline
     fn recv_raw(&mut self, deadline: Instant) -> Result<Option<RawPacket>> {
-        let port = &mut self.port;
-
-        while port.bytes_to_read()? < 2 {
-            if Instant::now() > deadline {
+        while self.rx_available() < 2 {
+            if !self.recv_fill(deadline)? {
                 return Ok(None);
             }
-            sleep(Duration::from_micros(10));
         }
 
         let mut data = [0u8; 32];
-        port.read_exact(&mut data[0..2])?;
+        self.read_exact(&mut data[0..2])?;
         let size = data[1] as usize;
 
         if size > 30 {
             return Err(anyhow!("Packet payload too large: {}", size));
         }
 
-        while port.bytes_to_read()? < size as u32 {
-            sleep(Duration::from_micros(10));
-        }
-
-        port.read_exact(&mut data[2..2 + size])?;
+        self.read_exact(&mut data[2..2 + size])?;
 
         let kind: Option<PacketKind> = FromPrimitive::from_u8(data[0]);
         if let Some(kind) = kind {
@@ -222,12 +742,146 @@ impl PicoLink {
                 Ok(Some(RespPacket::PointerCur(u32::from_le_bytes(arr))))
             }
             PacketKind::ReadData => Ok(Some(RespPacket::ReadData(payload.to_vec()))),
+            PacketKind::ReadBulkData => {
+                Ok(Some(RespPacket::ReadBulkData(self.recv_bulk(payload)?)))
+            }
+            PacketKind::BlockChecksumsData => {
+                let data = self.recv_bulk(payload)?;
+                let crcs = data
+                    .chunks_exact(4)
+                    .map(|x| u32::from_le_bytes(x.try_into().unwrap()))
+                    .collect();
+                Ok(Some(RespPacket::BlockChecksums(crcs)))
+            }
+            PacketKind::ChecksumResult => {
+                let arr = payload.try_into().unwrap_or_default();
+                Ok(Some(RespPacket::Checksum(u32::from_le_bytes(arr))))
+            }
+            PacketKind::ImageCur => {
+                let arr = payload.try_into().unwrap_or_default();
+                Ok(Some(RespPacket::ImageCur(u32::from_le_bytes(arr))))
+            }
+            PacketKind::SlotLoaded => {
+                if payload.len() >= 8 {
+                    let loaded = u32::from_le_bytes(payload[0..4].try_into()?);
+                    let committed = u32::from_le_bytes(payload[4..8].try_into()?);
+                    Ok(Some(RespPacket::SlotLoaded(loaded, committed)))
+                } else {
+                    Err(anyhow!(
+                        "SlotLoaded payload is too small: {}",
+                        payload.len()
+                    ))
+                }
+            }
+            PacketKind::LatencyResult => {
+                if payload.len() >= 20 {
+                    Ok(Some(RespPacket::LatencyResult(LatencyReport {
+                        sys_khz: u32::from_le_bytes(payload[0..4].try_into()?),
+                        addr: LatencyStats::decode(&payload[4..12]),
+                        oe: LatencyStats::decode(&payload[12..20]),
+                    })))
+                } else {
+                    Err(anyhow!(
+                        "LatencyResult payload is too small: {}",
+                        payload.len()
+                    ))
+                }
+            }
+            PacketKind::ClockCur => {
+                if payload.len() >= 8 {
+                    let profile = u32::from_le_bytes(payload[0..4].try_into()?);
+                    let khz = u32::from_le_bytes(payload[4..8].try_into()?);
+                    Ok(Some(RespPacket::ClockCur(profile, khz)))
+                } else {
+                    Err(anyhow!("ClockCur payload is too small: {}", payload.len()))
+                }
+            }
+            PacketKind::BootTime => {
+                if payload.len() >= 8 {
+                    let serving = u32::from_le_bytes(payload[0..4].try_into()?);
+                    let loaded = u32::from_le_bytes(payload[4..8].try_into()?);
+                    Ok(Some(RespPacket::BootTime(serving, loaded)))
+                } else {
+                    Err(anyhow!("BootTime payload is too small: {}", payload.len()))
+                }
+            }
+            PacketKind::StatsData => {
+                let data = self.recv_bulk(payload)?;
+                Ok(Some(RespPacket::Stats(Stats::decode(&data)?)))
+            }
+            PacketKind::TraceData => {
+                let total = u32::from_le_bytes(payload.get(4..8).unwrap_or(&[0; 4]).try_into()?);
+                let data = self.recv_bulk(payload)?;
+                let runs = data
+                    .chunks_exact(4)
+                    .map(|x| {
+                        let record = u32::from_le_bytes(x.try_into().unwrap());
+                        TraceRun {
+                            addr: record & 0x3ffff,
+                            len: (record >> 18) + 1,
+                        }
+                    })
+                    .collect();
+                Ok(Some(RespPacket::TraceData(total, runs)))
+            }
+            PacketKind::TriggerHit => {
+                if payload.len() >= 12 {
+                    let hit = TriggerHit {
+                        time_us: u32::from_le_bytes(payload[0..4].try_into()?),
+                        count: u32::from_le_bytes(payload[4..8].try_into()?),
+                        index: payload[8],
+                    };
+                    self.trigger_hits.push_back(hit);
+                    Ok(Some(RespPacket::TriggerHit(hit)))
+                } else {
+                    Err(anyhow!("Trigger payload is too small: {}", payload.len()))
+                }
+            }
+            PacketKind::CoverageData => {
+                Ok(Some(RespPacket::CoverageData(self.recv_bulk(payload)?)))
+            }
             PacketKind::CommitDone => Ok(Some(RespPacket::CommitDone)),
+            PacketKind::Done => Ok(Some(RespPacket::Done)),
             PacketKind::CommsData => Ok(Some(RespPacket::CommsData(payload.to_vec()))),
+            PacketKind::CommsCredit => {
+                let arr = payload.try_into().unwrap_or_default();
+                let credit = u32::from_le_bytes(arr);
+                self.comms_credit += credit as usize;
+                Ok(Some(RespPacket::CommsCredit(credit)))
+            }
+            PacketKind::WriteAck => {
+                let arr = payload.try_into().unwrap_or_default();
+                Ok(Some(RespPacket::WriteAck(u32::from_le_bytes(arr))))
+            }
+            PacketKind::WriteError => {
+                if payload.len() >= 12 {
+                    let seq = u32::from_le_bytes(payload[0..4].try_into()?);
+                    let offset = u32::from_le_bytes(payload[4..8].try_into()?);
+                    let size = u32::from_le_bytes(payload[8..12].try_into()?);
+                    Ok(Some(RespPacket::WriteError(seq, offset, size)))
+                } else {
+                    Err(anyhow!(
+                        "WriteError payload is too small: {}",
+                        payload.len()
+                    ))
+                }
+            }
             x => Err(anyhow::format_err!("Unexpected packet kind: {:?}", x)),
         }
     }
 
+    /// Receive the raw data following a bulk response, the header payload starts with its length
+    fn recv_bulk(&mut self, payload: &[u8]) -> Result<Vec<u8>> {
+        let arr = payload
+            .get(0..4)
+            .unwrap_or_default()
+            .try_into()
+            .unwrap_or_default();
+        let mut data = vec![0u8; u32::from_le_bytes(arr) as usize];
+        self.read_exact(&mut data)?;
+        Ok(data)
+    }
+
     fn recv_flush(&mut self) -> Result<()> {
         let deadline = Instant::now();
 
@@ -294,6 +948,28 @@ impl PicoLink {
         self.recv_until_with_timeout(f, Duration::from_millis(100))
     }
 
+    /// Wait for a Done, an error sent in the meantime is returned instead
+    fn recv_done(&mut self) -> Result<()> {
+        let deadline = Instant::now() + Duration::from_millis(100);
+
+        while let Some(pkt) = self.recv(deadline)? {
+            match pkt {
+                RespPacket::Debug(msg, v0, v1) => {
+                    if self.debug {
+                        eprintln!("DEBUG: '{}' [0x{:x}, 0x{:x}]", msg, v0, v1);
+                    }
+                }
+                RespPacket::Error(msg, v0, v1) => {
+                    return Err(anyhow!("{} [0x{:x}, 0x{:x}]", msg, v0, v1));
+                }
+                RespPacket::Done => return Ok(()),
+                _ => {}
+            }
+        }
+
+        Err(anyhow!("timeout"))
+    }
+
     pub fn get_ident(&mut self) -> Result<String> {
         self.send(ReqPacket::Ident)?;
         self.recv_until(|pkt| match pkt {
@@ -316,17 +992,157 @@ impl PicoLink {
         }
     }
 
+    /// Upload a whole image. Only one copy of a mirrored image is sent and
+    /// padding at the end of it is filled in, the PicoROM does the rest.
     pub fn upload<F>(&mut self, data: &[u8], addr_mask: u32, f: F) -> Result<()>
     where
         F: Fn(usize),
     {
-        self.send(ReqPacket::PointerSet(0))?;
+        let period = mirror_period(data);
+        let image = &data[..period];
+
+        let padding = match image.last() {
+            Some(&last) => image.iter().rev().take_while(|&&x| x == last).count(),
+            None => 0,
+        };
+        let content = if padding >= MIN_FILL_SIZE {
+            (period - padding).max(1)
+        } else {
+            period
+        };
+
+        self.upload_to(0, &image[..content], &f)?;
+
+        if content < period {
+            self.fill(content as u32, (period - content) as u32, image[period - 1])?;
+        }
+
+        // Each copy doubles the mirrored part
+        let mut len = period;
+        while len < data.len() {
+            let count = len.min(data.len() - len);
+            self.copy(0, len as u32, count as u32)?;
+            len += count;
+        }
+
+        f(data.len() - content);
+
+        self.verify(0, data, ChecksumSource::Ram)?;
+
+        self.serve_uploaded(addr_mask)
+    }
+
+    /// Serve an image uploaded to the start of the ROM buffer. A swap could
+    /// have left the second half being served, that would keep the old image.
+    fn serve_uploaded(&mut self, addr_mask: u32) -> Result<()> {
+        if self.image_base()? != 0 {
+            self.swap_image()?;
+        }
+
+        self.send(ReqPacket::MaskSet(addr_mask))
+    }
+
+    /// Fill len bytes of the ROM buffer at offset with value
+    pub fn fill(&mut self, offset: u32, len: u32, value: u8) -> Result<()> {
+        self.send(ReqPacket::Fill(offset, len, value))?;
+        self.recv_done()
+    }
+
+    /// Copy len bytes of the ROM buffer from src to dest. The destination
+    /// can't start inside the source, repeat copies to replicate something.
+    pub fn copy(&mut self, src: u32, dest: u32, len: u32) -> Result<()> {
+        self.send(ReqPacket::Copy(src, dest, len))?;
+        self.recv_done()
+    }
+
+    /// Upload data, only sending the blocks that differ from what the PicoROM already holds
+    pub fn upload_delta<F>(&mut self, data: &[u8], addr_mask: u32, f: F) -> Result<()>
+    where
+        F: Fn(usize),
+    {
+        let count = data.len() / DELTA_BLOCK_SIZE;
+        let remote = self.block_checksums(0, DELTA_BLOCK_SIZE as u32, count as u32)?;
+
+        // Runs of dirty blocks, any partial block at the end is always sent
+        let mut runs: Vec<(usize, usize)> = Vec::new();
+        for (idx, chunk) in data.chunks(DELTA_BLOCK_SIZE).enumerate() {
+            let start = idx * DELTA_BLOCK_SIZE;
+            let end = start + chunk.len();
+            if idx < count && remote[idx] == crc32(chunk) {
+                f(chunk.len());
+                continue;
+            }
+
+            match runs.last_mut() {
+                Some(run) if run.1 == start => run.1 = end,
+                _ => runs.push((start, end)),
+            }
+        }
+
+        for (start, end) in runs {
+            self.send(ReqPacket::PointerSet(start as u32))?;
+            self.write_windowed(&data[start..end], None, &f)?;
+        }
+
+        self.verify(0, data, ChecksumSource::Ram)?;
+
+        self.serve_uploaded(addr_mask)
+    }
+
+    /// Upload data into the half of the ROM buffer that isn't being served and
+    /// then switch to it, the target never sees a partially written image.
+    /// Only possible for images up to IMAGE_SLOT_SIZE.
+    pub fn upload_swap<F>(&mut self, data: &[u8], addr_mask: u32, f: F) -> Result<()>
+    where
+        F: Fn(usize),
+    {
+        if addr_mask as usize >= IMAGE_SLOT_SIZE {
+            return Err(anyhow!(
+                "Images larger than 0x{:x} bytes can't be swapped",
+                IMAGE_SLOT_SIZE
+            ));
+        }
+
+        self.send(ReqPacket::MaskSet(addr_mask))?;
 
-        for chunk in data.chunks(30) {
-            f(chunk.len());
-            self.send(ReqPacket::Write(chunk.to_vec()))?;
+        let staging = self.image_base()? ^ IMAGE_SLOT_SIZE as u32;
+        let len = data.len().min(IMAGE_SLOT_SIZE);
+        self.upload_to(staging, &data[..len], f)?;
+
+        let active = self.swap_image()?;
+        if active != staging {
+            return Err(anyhow!("Swap failed, serving 0x{:x}", active));
         }
 
+        Ok(())
+    }
+
+    /// Offset within the ROM buffer of the image being served
+    pub fn image_base(&mut self) -> Result<u32> {
+        self.send(ReqPacket::ImageGet)?;
+        self.recv_until(|x| match x {
+            RespPacket::ImageCur(x) => Some(x),
+            _ => None,
+        })
+    }
+
+    /// Switch to serving the other half of the ROM buffer, returns its offset
+    pub fn swap_image(&mut self) -> Result<u32> {
+        self.send(ReqPacket::ImageSwap)?;
+        self.recv_until(|x| match x {
+            RespPacket::ImageCur(x) => Some(x),
+            _ => None,
+        })
+    }
+
+    pub fn upload_to<F>(&mut self, addr: u32, data: &[u8], f: F) -> Result<()>
+    where
+        F: Fn(usize),
+    {
+        self.send(ReqPacket::PointerSet(addr))?;
+
+        self.write_windowed(data, None, f)?;
+
         self.send(ReqPacket::PointerGet)?;
 
         let cur = self.recv_until(|x| match x {
@@ -334,26 +1150,157 @@ impl PicoLink {
             _ => None,
         })?;
 
-        if cur != data.len() as u32 {
+        if (cur - addr) != data.len() as u32 {
             return Err(anyhow!("Upload did not complete."));
         }
 
-        self.send(ReqPacket::MaskSet(addr_mask))?;
+        self.verify(addr, data, ChecksumSource::Ram)
+    }
+
+    /// CRC32 of len bytes at offset, calculated by the PicoROM
+    pub fn checksum(&mut self, offset: u32, len: u32, source: ChecksumSource) -> Result<u32> {
+        self.send(ReqPacket::Checksum(offset, len, source))?;
+
+        self.recv_until(|x| match x {
+            RespPacket::Checksum(x) => Some(x),
+            _ => None,
+        })
+    }
+
+    /// CRC32 of each of count blocks of block_size bytes, starting at offset
+    pub fn block_checksums(
+        &mut self,
+        offset: u32,
+        block_size: u32,
+        count: u32,
+    ) -> Result<Vec<u32>> {
+        self.send(ReqPacket::BlockChecksums(offset, block_size, count))?;
+
+        let crcs = self.recv_until(|x| match x {
+            RespPacket::BlockChecksums(x) => Some(x),
+            _ => None,
+        })?;
+
+        if crcs.len() != count as usize {
+            return Err(anyhow!(
+                "Expected {} block checksums, PicoROM returned {}",
+                count,
+                crcs.len()
+            ));
+        }
+
+        Ok(crcs)
+    }
+
+    /// Check that the PicoROM holds data at addr
+    pub fn verify(&mut self, addr: u32, data: &[u8], source: ChecksumSource) -> Result<()> {
+        let expected = crc32(data);
+        let actual = self.checksum(addr, data.len() as u32, source)?;
+
+        if expected != actual {
+            return Err(anyhow!(
+                "Verify failed. Expected CRC 0x{:08x} but PicoROM returned 0x{:08x}",
+                expected,
+                actual
+            ));
+        }
 
         Ok(())
     }
 
-    pub fn upload_to<F>(&mut self, addr: u32, data: &[u8], f: F) -> Result<()>
+    /// Read len bytes of ROM data starting at addr
+    pub fn read(&mut self, addr: u32, len: u32) -> Result<Vec<u8>> {
+        self.send(ReqPacket::PointerSet(addr))?;
+        self.send(ReqPacket::ReadBulk(len))?;
+
+        self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::ReadBulkData(x) => Some(x),
+                _ => None,
+            },
+            Duration::from_secs(5),
+        )
+    }
+
+    /// Write data at the current pointer as sequenced bulk writes, keeping
+    /// up to WRITE_WINDOW of them in flight. Writes that get smaller when run
+    /// length encoded are sent compressed.
+    /// `f` is called with the number of bytes as each write is acknowledged.
+    fn write_windowed<F>(&mut self, data: &[u8], lane: Option<ByteLane>, f: F) -> Result<()>
     where
         F: Fn(usize),
     {
-        self.send(ReqPacket::PointerSet(addr))?;
+        let chunks: Vec<&[u8]> = data.chunks(BULK_CHUNK_SIZE).collect();
+        let mut sent = 0;
+        let mut acked = 0;
+
+        self.recv_flush()?;
 
-        for chunk in data.chunks(30) {
-            f(chunk.len());
-            self.send(ReqPacket::Write(chunk.to_vec()))?;
+        while acked < chunks.len() {
+            while sent < chunks.len() && (sent - acked) < WRITE_WINDOW {
+                let seq = (sent + 1) as u32;
+                let chunk = chunks[sent].to_vec();
+                self.send_posted(match lane {
+                    Some(lane) => ReqPacket::WriteBulkLane(seq, lane, chunk),
+                    None => {
+                        let encoded = rle::encode(&chunk);
+                        if encoded.len() < chunk.len() {
+                            ReqPacket::WriteCompressed(seq, chunk.len() as u32, encoded)
+                        } else {
+                            ReqPacket::WriteBulk(seq, chunk)
+                        }
+                    }
+                })?;
+                sent += 1;
+            }
+
+            let ack = self.recv_until_with_timeout(
+                |x| match x {
+                    RespPacket::WriteAck(seq) => Some(Ok(seq)),
+                    RespPacket::WriteError(seq, offset, size) => Some(Err((seq, offset, size))),
+                    _ => None,
+                },
+                Duration::from_secs(1),
+            )?;
+
+            match ack {
+                Ok(seq) => {
+                    let seq = (seq as usize).min(sent);
+                    for chunk in &chunks[acked.min(seq)..seq] {
+                        f(chunk.len());
+                    }
+                    acked = acked.max(seq);
+                }
+                Err((seq, offset, size)) => {
+                    return Err(anyhow!(
+                        "Write {} of {} bytes at 0x{:x} was rejected",
+                        seq,
+                        size,
+                        offset
+                    ));
+                }
+            }
         }
 
+        Ok(())
+    }
+
+    /// Upload one byte lane of an interleaved 16-bit image. The whole image is sent
+    /// and the PicoROM keeps every other byte, so it is half the size once stored.
+    pub fn upload_lane<F>(
+        &mut self,
+        data: &[u8],
+        lane: ByteLane,
+        addr_mask: u32,
+        f: F,
+    ) -> Result<()>
+    where
+        F: Fn(usize),
+    {
+        self.send(ReqPacket::PointerSet(0))?;
+
+        self.write_windowed(data, Some(lane), f)?;
+
         self.send(ReqPacket::PointerGet)?;
 
         let cur = self.recv_until(|x| match x {
@@ -361,11 +1308,14 @@ impl PicoLink {
             _ => None,
         })?;
 
-        if (cur - addr) != data.len() as u32 {
+        let stored = lane.extract(data);
+        if cur != stored.len() as u32 {
             return Err(anyhow!("Upload did not complete."));
         }
 
-        Ok(())
+        self.verify(0, &stored, ChecksumSource::Ram)?;
+
+        self.serve_uploaded(addr_mask)
     }
 
     pub fn commit_rom(&mut self) -> Result<()> {
@@ -380,25 +1330,239 @@ impl PicoLink {
         )
     }
 
+    /// Commit the ROM image to one of the flash slots, slot 0 is the same as commit_rom
+    pub fn commit_slot(&mut self, slot: u8) -> Result<()> {
+        self.send(ReqPacket::SlotCommit(slot))?;
+
+        self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::CommitDone => Some(()),
+                _ => None,
+            },
+            Duration::from_secs(5),
+        )
+    }
+
+    /// Replace the ROM image with one committed to a flash slot.
+    /// If boot is set it will also be loaded at startup.
+    pub fn load_slot(&mut self, slot: u8, boot: bool) -> Result<()> {
+        self.send(ReqPacket::SlotLoad(slot, boot))?;
+
+        let (loaded, committed) = self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::SlotLoaded(loaded, committed) => Some((loaded, committed)),
+                _ => None,
+            },
+            Duration::from_secs(1),
+        )?;
+
+        if loaded != committed {
+            return Err(anyhow!(
+                "Slot {} is corrupt. Expected CRC 0x{:08x} but loaded 0x{:08x}",
+                slot,
+                committed,
+                loaded
+            ));
+        }
+
+        Ok(())
+    }
+
+    /// Current clock profile and the system clock in kHz
+    pub fn get_clock(&mut self) -> Result<(ClockProfile, u32)> {
+        self.send(ReqPacket::ClockGet)?;
+        self.recv_clock()
+    }
+
+    /// Change and persist the clock profile, returns the new system clock in kHz
+    pub fn set_clock(&mut self, profile: ClockProfile) -> Result<u32> {
+        self.send(ReqPacket::ClockSet(profile))?;
+        let (cur, khz) = self.recv_clock()?;
+        if cur != profile {
+            return Err(anyhow!("Clock profile not set, PicoROM is using {:?}", cur));
+        }
+        Ok(khz)
+    }
+
+    fn recv_clock(&mut self) -> Result<(ClockProfile, u32)> {
+        let (profile, khz) = self.recv_until(|x| match x {
+            RespPacket::ClockCur(profile, khz) => Some((profile, khz)),
+            _ => None,
+        })?;
+
+        let profile = FromPrimitive::from_u32(profile)
+            .ok_or_else(|| anyhow!("Unknown clock profile: {}", profile))?;
+        Ok((profile, khz))
+    }
+
+    /// Microseconds from reset until the ROM was being served and until the whole image was loaded
+    pub fn boot_time(&mut self) -> Result<(u32, u32)> {
+        self.send(ReqPacket::BootTimeGet)?;
+        self.recv_until(|x| match x {
+            RespPacket::BootTime(serving, loaded) => Some((serving, loaded)),
+            _ => None,
+        })
+    }
+
+    /// The PicoROM's performance counters
+    pub fn get_stats(&mut self) -> Result<Stats> {
+        self.send(ReqPacket::StatsGet)?;
+        self.recv_until(|x| match x {
+            RespPacket::Stats(stats) => Some(stats),
+            _ => None,
+        })
+    }
+
+    /// Start recording every access the target makes, discarding any previous trace.
+    /// Only possible while the image being served is smaller than 224KB.
+    pub fn trace_start(&mut self) -> Result<()> {
+        self.send(ReqPacket::TraceStart)?;
+        self.recv_done()
+    }
+
+    /// Stop tracing and return the total number of accesses and the most recent runs of them
+    pub fn trace_read(&mut self) -> Result<(u32, Vec<TraceRun>)> {
+        self.send(ReqPacket::TraceRead)?;
+
+        self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::TraceData(total, runs) => Some((total, runs)),
+                _ => None,
+            },
+            Duration::from_secs(1),
+        )
+    }
+
+    /// Start marking every COVERAGE_BLOCK_SIZE block the target reads from.
+    /// This clears the map and replaces any trace, the two share a buffer.
+    pub fn coverage_start(&mut self) -> Result<()> {
+        self.send(ReqPacket::CoverageStart)?;
+        self.recv_done()
+    }
+
+    /// Read which blocks have been accessed since coverage was started or last cleared
+    pub fn coverage_read(&mut self, clear: bool) -> Result<Vec<bool>> {
+        self.send(ReqPacket::CoverageRead(clear))?;
+
+        let map = self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::CoverageData(map) => Some(map),
+                _ => None,
+            },
+            Duration::from_secs(1),
+        )?;
+
+        Ok((0..map.len() * 8)
+            .map(|i| map[i / 8] & (1 << (i % 8)) != 0)
+            .collect())
+    }
+
+    /// Set one of the N_TRIGGERS address triggers, or disable it with None.
+    /// Addresses are relative to the image being served.
+    pub fn set_trigger(&mut self, index: u8, trigger: Option<Trigger>) -> Result<()> {
+        if index >= N_TRIGGERS {
+            return Err(anyhow!("Invalid trigger: {}", index));
+        }
+        self.send(ReqPacket::TriggerSet(index, trigger))
+    }
+
+    /// Return the oldest unseen trigger hit, waiting up to timeout for one
+    pub fn wait_trigger(&mut self, timeout: Duration) -> Result<Option<TriggerHit>> {
+        let deadline = Instant::now() + timeout;
+
+        while self.trigger_hits.is_empty() {
+            if self.recv(deadline)?.is_none() {
+                break;
+            }
+        }
+
+        Ok(self.trigger_hits.pop_front())
+    }
+
+    /// Measure the PicoROM's own access times.
+    /// It drives its address and OE/CE pins to do this so it must not be plugged into a target.
+    pub fn latency_test(&mut self, samples: u16) -> Result<LatencyReport> {
+        self.send(ReqPacket::LatencyTest(samples))?;
+
+        self.recv_until_with_timeout(
+            |x| match x {
+                RespPacket::LatencyResult(x) => Some(x),
+                _ => None,
+            },
+            Duration::from_secs(5),
+        )
+    }
+
     pub fn identify(&mut self) -> Result<()> {
         self.send(ReqPacket::Identify)?;
         Ok(())
     }
 
+    /// Wait up to timeout for comms data, returning as soon as any has arrived
+    pub fn wait_comms(&mut self, timeout: Duration) -> Result<Vec<u8>> {
+        let deadline = Instant::now() + timeout;
+        let mut incoming = Vec::new();
+
+        loop {
+            let until = if incoming.is_empty() {
+                deadline
+            } else {
+                Instant::now()
+            };
+            match self.recv(until)? {
+                Some(RespPacket::CommsData(data)) => incoming.extend_from_slice(&data),
+                Some(_) => {}
+                None => break,
+            }
+        }
+
+        Ok(incoming)
+    }
+
+    /// Start two-way communications with the target, see poll_comms
+    pub fn comms_start(&mut self, addr: u32, block: bool) -> Result<()> {
+        self.comms_credit = 0;
+        self.send(ReqPacket::CommsStart(addr, block))
+    }
+
+    /// End communications. Anything sent before is received first, so no
+    /// credit from this session is left to be counted in the next.
+    pub fn comms_end(&mut self) -> Result<()> {
+        self.send(ReqPacket::CommsEnd)?;
+        self.recv_done()?;
+        self.comms_credit = 0;
+        Ok(())
+    }
+
+    /// Send outgoing to the target and return what it has sent. Only as much
+    /// as the PicoROM has credit for is sent at once, the rest waits for the
+    /// target to read it.
     pub fn poll_comms(&mut self, outgoing: Option<Vec<u8>>) -> Result<Vec<u8>> {
         let mut incoming = Vec::new();
         if let Some(outgoing) = outgoing {
-            for chunk in outgoing.chunks(30) {
-                while let Some(pkt) = self.recv(Instant::now())? {
-                    match pkt {
-                        RespPacket::CommsData(data) => {
-                            incoming.extend_from_slice(&data);
-                        }
-                        _ => {}
+            let mut pos = 0;
+            let mut deadline = Instant::now() + COMMS_SEND_TIMEOUT;
+
+            while pos < outgoing.len() {
+                let until = if self.comms_credit == 0 {
+                    deadline
+                } else {
+                    Instant::now()
+                };
+                match self.recv(until)? {
+                    Some(RespPacket::CommsData(data)) => incoming.extend_from_slice(&data),
+                    Some(_) => {}
+                    None if self.comms_credit == 0 => return Err(anyhow!("Comms send timeout")),
+                    None => {
+                        let len = (outgoing.len() - pos).min(self.comms_credit).min(30);
+                        let pkt =
+                            ReqPacket::CommsData(outgoing[pos..pos + len].to_vec()).encode()?;
+                        self.port.write_all(&pkt)?;
+                        self.comms_credit -= len;
+                        pos += len;
+                        deadline = Instant::now() + COMMS_SEND_TIMEOUT;
                     }
                 }
-                let pkt = ReqPacket::CommsData(chunk.to_vec()).encode()?;
-                self.port.write_all(&pkt)?;
             }
         }
         while let Some(pkt) = self.recv(Instant::now())? {
@@ -414,16 +1578,50 @@ impl PicoLink {
     }
 }
 
-/// Find all USB serial ports matching the PicoROM VID:PID
-fn enumerate_ports() -> Result<Vec<String>> {
+/// Smallest power of two size that data is a repeat of
+fn mirror_period(data: &[u8]) -> usize {
+    let mut period = data.len();
+    while period % 2 == 0 && period > 1 && data[..period / 2] == data[period / 2..period] {
+        period /= 2;
+    }
+    period
+}
+
+/// CRC32 as calculated by PicoROM's Checksum command (the zlib/IEEE 802.3 one)
+pub fn crc32(data: &[u8]) -> u32 {
+    let mut crc = 0xffffffffu32;
+    for byte in data {
+        crc ^= *byte as u32;
+        for _ in 0..8 {
+            crc = if crc & 1 != 0 {
+                (crc >> 1) ^ 0xedb88320
+            } else {
+                crc >> 1
+            };
+        }
+    }
+    !crc
+}
+
+/// Find all USB serial ports matching the PicoROM VID:PID and product
+/// Returns the port name and USB serial number of each
+fn enumerate_ports() -> Result<Vec<(String, Option<String>)>> {
     let mut ports = Vec::new();
     let all_ports = serialport::available_ports()?;
 
     for p in all_ports.iter() {
         match &p.port_type {
             serialport::SerialPortType::UsbPort(info) => {
-                if info.vid == 0x2e8a && info.pid == 0x000a {
-                    ports.push(p.port_name.clone());
+                // Anything built with the Pico SDK has the same VID:PID. Windows
+                // reports the driver's description instead of the product string.
+                let product = cfg!(windows)
+                    || info
+                        .product
+                        .as_deref()
+                        .map_or(true, |x| x.starts_with("PicoROM"));
+
+                if info.vid == 0x2e8a && info.pid == 0x000a && product {
+                    ports.push((p.port_name.clone(), info.serial_number.clone()));
                 }
             }
             _ => {}
@@ -433,21 +1631,134 @@ fn enumerate_ports() -> Result<Vec<String>> {
     Ok(ports)
 }
 
-pub fn enumerate_picos() -> Result<HashMap<String, PicoLink>> {
-    let mut found = HashMap::new();
-    for p in enumerate_ports()?.iter() {
-        let link = PicoLink::open(p, false);
-        if let Ok(mut link) = link {
-            if let Ok(ident) = link.get_ident() {
-                found.insert(ident, link);
-            }
+/// Open a PicoROM, preferring the bulk interface when the firmware and OS allow it
+fn open_port(port_path: &str, _serial_number: Option<&str>, debug: bool) -> Result<PicoLink> {
+    #[cfg(feature = "usb-bulk")]
+    if let Some(serial_number) = _serial_number {
+        if let Ok(link) = PicoLink::open_usb(serial_number, debug) {
+            return Ok(link);
         }
     }
 
+    PicoLink::open(port_path, debug)
+}
+
+pub fn enumerate_picos() -> Result<HashMap<String, PicoLink>> {
+    let ports = enumerate_ports()?;
+
+    // Opening waits on each device, so they are all opened at once
+    let found = std::thread::scope(|s| {
+        let handles: Vec<_> = ports
+            .iter()
+            .map(|(p, serial_number)| {
+                s.spawn(move || {
+                    let mut link = open_port(p, serial_number.as_deref(), false).ok()?;
+                    let ident = link.get_ident().ok()?;
+                    remember_name(p, serial_number.as_deref(), &ident);
+                    Some((ident, link))
+                })
+            })
+            .collect();
+
+        handles
+            .into_iter()
+            .filter_map(|h| h.join().ok().flatten())
+            .collect()
+    });
+
     Ok(found)
 }
 
+/// Name of each PicoROM opened so far, by port along with the serial number
+/// the port had then. A different serial number means it is out of date.
+/// This only lasts as long as the process, so it saves reopening ports for
+/// long lived users of the library but not between runs of the CLI.
+static PORT_NAMES: Mutex<BTreeMap<String, (Option<String>, String)>> = Mutex::new(BTreeMap::new());
+
+fn remember_name(port_path: &str, serial_number: Option<&str>, name: &str) {
+    if let Ok(mut names) = PORT_NAMES.lock() {
+        names.insert(
+            port_path.to_string(),
+            (serial_number.map(str::to_string), name.to_string()),
+        );
+    }
+}
+
+fn remembered_name(port_path: &str, serial_number: Option<&str>) -> Option<String> {
+    let names = PORT_NAMES.lock().ok()?;
+    let (serial, name) = names.get(port_path)?;
+    if serial.as_deref() == serial_number {
+        Some(name.clone())
+    } else {
+        None
+    }
+}
+
+/// The name a port is expected to have without opening it. The firmware
+/// publishes its name as the USB serial number.
+fn port_name(port_path: &str, serial_number: Option<&str>) -> Option<String> {
+    remembered_name(port_path, serial_number).or(serial_number.map(str::to_string))
+}
+
+/// Serial numbers of unnamed PicoROMs, earlier firmware and anything else
+/// built with the Pico SDK
+fn is_board_id(serial_number: &str) -> bool {
+    serial_number.len() == 16 && serial_number.bytes().all(|x| x.is_ascii_hexdigit())
+}
+
+/// Names of the connected PicoROMs. Only ports without a name in their
+/// serial number are opened to ask for it.
+pub fn enumerate_names() -> Result<Vec<String>> {
+    let ports = enumerate_ports()?;
+
+    let mut names: Vec<String> = std::thread::scope(|s| {
+        let handles: Vec<_> = ports
+            .iter()
+            .map(|(p, serial_number)| {
+                s.spawn(move || {
+                    let serial_number = serial_number.as_deref();
+                    if let Some(name) = remembered_name(p, serial_number) {
+                        return Some(name);
+                    }
+                    if let Some(name) = serial_number.filter(|x| !is_board_id(x)) {
+                        return Some(name.to_string());
+                    }
+
+                    let mut link = open_port(p, serial_number, false).ok()?;
+                    let ident = link.get_ident().ok()?;
+                    remember_name(p, serial_number, &ident);
+                    Some(ident)
+                })
+            })
+            .collect();
+
+        handles
+            .into_iter()
+            .filter_map(|h| h.join().ok().flatten())
+            .collect()
+    });
+
+    names.sort();
+    Ok(names)
+}
+
 pub fn find_pico(name: &str) -> Result<PicoLink> {
+    // Only open the port that should be it, unless it turns out not to be
+    for (p, serial_number) in enumerate_ports()?.iter() {
+        if port_name(p, serial_number.as_deref()).as_deref() != Some(name) {
+            continue;
+        }
+
+        if let Ok(mut link) = open_port(p, serial_number.as_deref(), false) {
+            if let Ok(ident) = link.get_ident() {
+                remember_name(p, serial_number.as_deref(), &ident);
+                if ident == name {
+                    return Ok(link);
+                }
+            }
+        }
+    }
+
     let mut found = enumerate_picos()?;
 
     if let Some(pico) = found.remove(name) {
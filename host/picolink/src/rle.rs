@@ -0,0 +1,115 @@
+//! Run length encoding for compressed bulk writes, the PicoROM decodes it
+//! straight into the ROM buffer (see pl_begin_bulk_rle in the firmware).
+
+const MIN_RUN: usize = 3;
+const MAX_RUN: usize = MIN_RUN + 0x7fff;
+const MAX_LITERAL: usize = 0x80;
+
+/// Encode data, runs of MIN_RUN or more bytes become a three byte repeat
+pub fn encode(data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::new();
+    let mut literal_start = 0;
+    let mut pos = 0;
+
+    while pos < data.len() {
+        let value = data[pos];
+        let run = data[pos..]
+            .iter()
+            .take(MAX_RUN)
+            .take_while(|&&x| x == value)
+            .count();
+
+        if run >= MIN_RUN {
+            push_literals(&mut out, &data[literal_start..pos]);
+            let count = run - MIN_RUN;
+            out.push(0x80 | (count >> 8) as u8);
+            out.push(count as u8);
+            out.push(value);
+            literal_start = pos + run;
+        }
+        pos += run;
+    }
+
+    push_literals(&mut out, &data[literal_start..]);
+    out
+}
+
+fn push_literals(out: &mut Vec<u8>, data: &[u8]) {
+    for chunk in data.chunks(MAX_LITERAL) {
+        out.push((chunk.len() - 1) as u8);
+        out.extend_from_slice(chunk);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Mirrors rle_decode in the firmware
+    fn decode(data: &[u8]) -> Vec<u8> {
+        let mut out = Vec::new();
+        let mut pos = 0;
+
+        while pos < data.len() {
+            let control = data[pos] as usize;
+            if control < 0x80 {
+                let len = control + 1;
+                out.extend_from_slice(&data[pos + 1..pos + 1 + len]);
+                pos += 1 + len;
+            } else {
+                let count = (((control & 0x7f) << 8) | data[pos + 1] as usize) + MIN_RUN;
+                out.extend(std::iter::repeat(data[pos + 2]).take(count));
+                pos += 3;
+            }
+        }
+
+        out
+    }
+
+    fn round_trip(data: &[u8]) -> Vec<u8> {
+        let encoded = encode(data);
+        assert_eq!(decode(&encoded), data);
+        encoded
+    }
+
+    #[test]
+    fn empty() {
+        assert!(round_trip(&[]).is_empty());
+    }
+
+    #[test]
+    fn shortest_run() {
+        assert_eq!(round_trip(&[7; MIN_RUN]), [0x80, 0x00, 7]);
+        assert_eq!(round_trip(&[7; MIN_RUN - 1]), [1, 7, 7]);
+    }
+
+    #[test]
+    fn longest_run() {
+        assert_eq!(round_trip(&vec![0xff; MAX_RUN]), [0xff, 0xff, 0xff]);
+
+        let encoded = round_trip(&vec![0xff; MAX_RUN + 1]);
+        assert_eq!(encoded, [0xff, 0xff, 0xff, 0x00, 0xff]);
+    }
+
+    #[test]
+    fn longest_literal() {
+        let data: Vec<u8> = (0..MAX_LITERAL).map(|x| x as u8).collect();
+        let encoded = round_trip(&data);
+        assert_eq!(encoded.len(), MAX_LITERAL + 1);
+        assert_eq!(encoded[0], (MAX_LITERAL - 1) as u8);
+
+        let data: Vec<u8> = (0..=MAX_LITERAL).map(|x| x as u8).collect();
+        let encoded = round_trip(&data);
+        assert_eq!(encoded.len(), MAX_LITERAL + 3);
+        assert_eq!(encoded[MAX_LITERAL + 1], 0);
+    }
+
+    #[test]
+    fn mixed() {
+        let mut data: Vec<u8> = (0..300).map(|x| (x * 7) as u8).collect();
+        data.extend(std::iter::repeat(0x55).take(1000));
+        data.extend_from_slice(&[1, 2, 2, 3, 3, 3, 4]);
+        data.extend(std::iter::repeat(0).take(MAX_RUN * 2 + 5));
+        round_trip(&data);
+    }
+}
@@ -0,0 +1,271 @@
+use anyhow::Result;
+use serialport::SerialPort;
+use std::io::{ErrorKind, Read, Write};
+use std::time::Duration;
+
+/// The incoming half of a byte stream from a PicoROM
+pub trait TransportReader: Send {
+    /// Read as much as is available, up to buf.len(), waiting up to timeout
+    /// for something to arrive. Returns 0 if nothing did.
+    fn read(&mut self, buf: &mut [u8], timeout: Duration) -> Result<usize>;
+}
+
+/// A byte stream to a PicoROM
+pub trait Transport: TransportReader {
+    fn write_all(&mut self, data: &[u8]) -> Result<()>;
+
+    /// A reader that can be moved to another thread, only it should be read from afterwards
+    fn split_reader(&mut self) -> Result<Box<dyn TransportReader>>;
+}
+
+/// The CDC serial interface, opened through the OS serial stack
+pub struct SerialTransport {
+    port: Box<dyn SerialPort>,
+}
+
+impl SerialTransport {
+    pub fn open(port_path: &str) -> Result<SerialTransport> {
+        let mut port = serialport::new(port_path, 9600)
+            .timeout(std::time::Duration::from_millis(1000))
+            .open()?;
+
+        port.write_data_terminal_ready(true)?;
+
+        Ok(SerialTransport { port })
+    }
+}
+
+impl TransportReader for SerialTransport {
+    fn read(&mut self, buf: &mut [u8], timeout: Duration) -> Result<usize> {
+        self.port.set_timeout(timeout)?;
+        match self.port.read(buf) {
+            Ok(count) => Ok(count),
+            Err(e) if e.kind() == ErrorKind::TimedOut => Ok(0),
+            Err(e) => Err(e.into()),
+        }
+    }
+}
+
+impl Transport for SerialTransport {
+    fn write_all(&mut self, data: &[u8]) -> Result<()> {
+        Ok(self.port.write_all(data)?)
+    }
+
+    fn split_reader(&mut self) -> Result<Box<dyn TransportReader>> {
+        Ok(Box::new(SerialTransport {
+            port: self.port.try_clone()?,
+        }))
+    }
+}
+
+#[cfg(feature = "usb-bulk")]
+pub use usb::UsbTransport;
+
+#[cfg(feature = "usb-bulk")]
+mod usb {
+    use super::{Transport, TransportReader};
+    use anyhow::{anyhow, Result};
+    use rusb::{Direction, GlobalContext, Recipient, RequestType, TransferType};
+    use std::sync::Arc;
+    use std::time::Duration;
+
+    const PICOROM_VID: u16 = 0x2e8a;
+    const PICOROM_PID: u16 = 0x000a;
+
+    /// bRequest for opening and closing a session, see firmware/usb_descriptors.h
+    const VENDOR_REQUEST_CONNECT: u8 = 2;
+
+    const TIMEOUT: Duration = Duration::from_millis(1000);
+
+    /// libusb takes a timeout of 0 to mean none at all
+    const MIN_TIMEOUT: Duration = Duration::from_millis(1);
+
+    /// Size of a full speed bulk packet. Reads are done one packet at a time,
+    /// a libusb read that times out part way through a transfer loses its data.
+    const PACKET_SIZE: usize = 64;
+
+    /// The vendor bulk interface, talking to the endpoints directly through libusb
+    pub struct UsbTransport {
+        handle: Arc<rusb::DeviceHandle<GlobalContext>>,
+        interface: u8,
+        ep_out: u8,
+        reader: Option<UsbReader>,
+    }
+
+    /// The IN endpoint, the handle is shared so it can be read from its own thread
+    struct UsbReader {
+        handle: Arc<rusb::DeviceHandle<GlobalContext>>,
+        ep_in: u8,
+        rx: Vec<u8>,
+        rx_pos: usize,
+    }
+
+    impl UsbTransport {
+        /// Open the bulk interface of the PicoROM with the given USB serial number
+        pub fn open(serial_number: &str) -> Result<UsbTransport> {
+            for device in rusb::devices()?.iter() {
+                let desc = device.device_descriptor()?;
+                if desc.vendor_id() != PICOROM_VID || desc.product_id() != PICOROM_PID {
+                    continue;
+                }
+
+                let handle = match device.open() {
+                    Ok(handle) => handle,
+                    Err(_) => continue,
+                };
+
+                match handle.read_serial_number_string_ascii(&desc) {
+                    Ok(serial) if serial == serial_number => {}
+                    _ => continue,
+                }
+
+                return UsbTransport::claim(&device, handle);
+            }
+
+            Err(anyhow!("No bulk interface found for '{}'", serial_number))
+        }
+
+        fn claim(
+            device: &rusb::Device<GlobalContext>,
+            mut handle: rusb::DeviceHandle<GlobalContext>,
+        ) -> Result<UsbTransport> {
+            let config = device.active_config_descriptor()?;
+
+            for interface in config.interfaces() {
+                for desc in interface.descriptors() {
+                    if desc.class_code() != 0xff {
+                        continue;
+                    }
+
+                    let mut ep_in = None;
+                    let mut ep_out = None;
+                    for ep in desc.endpoint_descriptors() {
+                        if ep.transfer_type() != TransferType::Bulk {
+                            continue;
+                        }
+                        match ep.direction() {
+                            Direction::In => ep_in = Some(ep.address()),
+                            Direction::Out => ep_out = Some(ep.address()),
+                        }
+                    }
+
+                    if let (Some(ep_in), Some(ep_out)) = (ep_in, ep_out) {
+                        let interface = desc.interface_number();
+
+                        // Not supported on every platform, the claim will tell us if it mattered
+                        let _ = handle.set_auto_detach_kernel_driver(true);
+                        handle.claim_interface(interface)?;
+
+                        let handle = Arc::new(handle);
+                        let transport = UsbTransport {
+                            handle: handle.clone(),
+                            interface,
+                            ep_out,
+                            reader: Some(UsbReader {
+                                handle,
+                                ep_in,
+                                rx: Vec::new(),
+                                rx_pos: 0,
+                            }),
+                        };
+                        transport.connect(true)?;
+                        return Ok(transport);
+                    }
+                }
+            }
+
+            Err(anyhow!("PicoROM has no bulk interface"))
+        }
+
+        fn connect(&self, connected: bool) -> Result<()> {
+            self.handle.write_control(
+                rusb::request_type(Direction::Out, RequestType::Vendor, Recipient::Interface),
+                VENDOR_REQUEST_CONNECT,
+                connected as u16,
+                self.interface as u16,
+                &[],
+                TIMEOUT,
+            )?;
+            Ok(())
+        }
+    }
+
+    impl Drop for UsbTransport {
+        fn drop(&mut self) {
+            let _ = self.connect(false);
+
+            // Any reader split off has to have gone for the handle to be released
+            self.reader = None;
+            if let Some(handle) = Arc::get_mut(&mut self.handle) {
+                let _ = handle.release_interface(self.interface);
+            }
+        }
+    }
+
+    impl UsbReader {
+        /// Read a single packet into the receive buffer
+        fn fill(&mut self, timeout: Duration) -> Result<usize> {
+            if self.rx_pos == self.rx.len() {
+                self.rx.clear();
+                self.rx_pos = 0;
+            }
+
+            let start = self.rx.len();
+            self.rx.resize(start + PACKET_SIZE, 0);
+            let res =
+                self.handle
+                    .read_bulk(self.ep_in, &mut self.rx[start..], timeout.max(MIN_TIMEOUT));
+            let count = match res {
+                Ok(count) => count,
+                Err(rusb::Error::Timeout) => 0,
+                Err(e) => {
+                    self.rx.truncate(start);
+                    return Err(e.into());
+                }
+            };
+            self.rx.truncate(start + count);
+
+            Ok(count)
+        }
+    }
+
+    impl TransportReader for UsbReader {
+        fn read(&mut self, buf: &mut [u8], timeout: Duration) -> Result<usize> {
+            if self.rx_pos == self.rx.len() {
+                self.fill(timeout)?;
+            }
+
+            let count = buf.len().min(self.rx.len() - self.rx_pos);
+            buf[..count].copy_from_slice(&self.rx[self.rx_pos..self.rx_pos + count]);
+            self.rx_pos += count;
+
+            Ok(count)
+        }
+    }
+
+    impl TransportReader for UsbTransport {
+        fn read(&mut self, buf: &mut [u8], timeout: Duration) -> Result<usize> {
+            match &mut self.reader {
+                Some(reader) => reader.read(buf, timeout),
+                None => Err(anyhow!("Bulk reader has been split off")),
+            }
+        }
+    }
+
+    impl Transport for UsbTransport {
+        fn write_all(&mut self, data: &[u8]) -> Result<()> {
+            let mut pos = 0;
+            while pos < data.len() {
+                pos += self.handle.write_bulk(self.ep_out, &data[pos..], TIMEOUT)?;
+            }
+            Ok(())
+        }
+
+        fn split_reader(&mut self) -> Result<Box<dyn TransportReader>> {
+            match self.reader.take() {
+                Some(reader) => Ok(Box::new(reader)),
+                None => Err(anyhow!("Bulk reader has already been split off")),
+            }
+        }
+    }
+}
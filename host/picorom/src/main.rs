@@ -1,12 +1,13 @@
 use anyhow::{anyhow, Result};
-use clap::{Parser, Subcommand};
+use clap::{Parser, Subcommand, ValueEnum};
 use indicatif;
+use indicatif::MultiProgress;
 use indicatif::ProgressBar;
 use indicatif::ProgressStyle;
 use std::fs;
 use std::iter;
 use std::path::{Path, PathBuf};
-use std::time::Duration;
+use std::time::{Duration, Instant};
 
 use picolink::*;
 
@@ -30,6 +31,52 @@ fn read_file(name: &Path, rom_size: RomSize) -> Result<Vec<u8>> {
     Ok(data.repeat(RomSize::MBit(2).bytes() / rom_size.bytes()))
 }
 
+fn parse_hex(s: &str) -> Result<u32, std::num::ParseIntError> {
+    let digits = s.trim_start_matches("0x").trim_start_matches("0X");
+    u32::from_str_radix(digits, 16)
+}
+
+/// Read a 16-bit image for a pair of PicoROMs, both halves mirrored to fill them like read_file
+fn read_wide_file(name: &Path, rom_size: RomSize) -> Result<Vec<u8>> {
+    let mut data = fs::read(name)?;
+    let wide_size = rom_size.bytes() * 2;
+    if data.len() > wide_size {
+        return Err(anyhow!(
+            "{:?} larger ({}) than the size of two roms ({})",
+            name,
+            data.len(),
+            wide_size
+        ));
+    }
+
+    data.resize(wide_size, 0u8);
+
+    Ok(data.repeat(RomSize::MBit(2).bytes() / rom_size.bytes()))
+}
+
+#[derive(Debug, Clone, Copy, ValueEnum)]
+enum Clock {
+    /// 160MHz
+    Standard,
+    /// 100MHz
+    Low,
+    /// 200MHz
+    Fast,
+    /// 250MHz
+    Fastest,
+}
+
+impl Clock {
+    fn profile(&self) -> ClockProfile {
+        match self {
+            Clock::Standard => ClockProfile::Standard,
+            Clock::Low => ClockProfile::Low,
+            Clock::Fast => ClockProfile::Fast,
+            Clock::Fastest => ClockProfile::Fastest,
+        }
+    }
+}
+
 #[derive(Debug, Parser)] // requires `derive` feature
 #[command(name = "picorom")]
 #[command(about = "PicoROM controller", long_about = None)]
@@ -53,6 +100,96 @@ enum Commands {
     Commit {
         /// PicoROM device name.
         name: String,
+        /// Flash slot to store it in, slot 0 is loaded at startup by default.
+        #[arg(long, default_value_t = 0)]
+        slot: u8,
+    },
+
+    /// Replace the current ROM image with one stored in a flash slot
+    Load {
+        /// PicoROM device name.
+        name: String,
+        /// Flash slot to load.
+        slot: u8,
+        /// Also load this slot at startup.
+        #[arg(short, long, default_value_t = false)]
+        boot: bool,
+    },
+
+    /// Measure the access times of a PicoROM. It must NOT be plugged into a target
+    /// while doing this, it drives its own address and OE/CE pins.
+    Latency {
+        /// PicoROM device name.
+        name: String,
+        /// Number of measurements to take.
+        #[arg(long, default_value_t = 256)]
+        samples: u16,
+    },
+
+    /// Measure how long a PicoROM takes to answer a request.
+    Ping {
+        /// PicoROM device name.
+        name: String,
+        /// Number of requests to time.
+        #[arg(long, default_value_t = 100)]
+        count: u32,
+    },
+
+    /// Trace the accesses a target makes. Run with --start to begin recording
+    /// and again without it to stop and print what was recorded.
+    Trace {
+        /// PicoROM device name.
+        name: String,
+        /// Start a new trace.
+        #[arg(long, default_value_t = false)]
+        start: bool,
+    },
+
+    /// Report which parts of the image a target has read. Run with --start
+    /// to begin recording and again without it to print the covered ranges.
+    Coverage {
+        /// PicoROM device name.
+        name: String,
+        /// Start recording, clearing any previous coverage.
+        #[arg(long, default_value_t = false)]
+        start: bool,
+        /// Clear the coverage once it has been read.
+        #[arg(long, default_value_t = false)]
+        clear: bool,
+    },
+
+    /// Report every read a target makes of the given addresses, until interrupted.
+    Watch {
+        /// PicoROM device name.
+        name: String,
+        /// Addresses to watch, in hex.
+        #[arg(required = true, num_args = 1..=N_TRIGGERS as usize, value_parser = parse_hex)]
+        addrs: Vec<u32>,
+    },
+
+    /// Show or change the system clock of a PicoROM, the setting is persisted.
+    Clock {
+        /// PicoROM device name.
+        name: String,
+        /// New clock profile.
+        #[arg(value_enum, ignore_case = true)]
+        profile: Option<Clock>,
+    },
+
+    /// Show how long after power up a PicoROM started serving its image.
+    BootTime {
+        /// PicoROM device name.
+        name: String,
+    },
+
+    /// Show the performance counters of a PicoROM. With an interval they are
+    /// read twice and shown as rates.
+    Stats {
+        /// PicoROM device name.
+        name: String,
+        /// Seconds between the two reads.
+        #[arg(short, long)]
+        interval: Option<f32>,
     },
 
     /// Change the name of a PicoROM device.
@@ -75,6 +212,71 @@ enum Commands {
         /// Store the uploaded image in flash memory also.
         #[arg(short, long, default_value_t = false)]
         store: bool,
+        /// Only send the parts of the image that have changed.
+        #[arg(short, long, default_value_t = false)]
+        delta: bool,
+        /// Stage the image while the current one is still being served, then
+        /// switch to it. Only for ROMs up to 1MBit.
+        #[arg(short = 'w', long, default_value_t = false, conflicts_with = "delta")]
+        swap: bool,
+    },
+
+    /// Upload the same ROM image to several PicoROMs at once, all of those
+    /// connected unless they are named.
+    UploadAll {
+        /// Path of file to upload.
+        source: PathBuf,
+        /// Emulate a specific ROM size.
+        #[arg(value_enum, ignore_case=true, default_value_t=RomSize::MBit(2))]
+        size: RomSize,
+        /// Store the uploaded image in flash memory also.
+        #[arg(short, long, default_value_t = false)]
+        store: bool,
+        /// PicoROM device name, can be given more than once.
+        #[arg(short, long = "name")]
+        names: Vec<String>,
+    },
+
+    /// Upload a 16-bit ROM image to a pair of PicoROMs, one for each byte lane.
+    /// Each is sent the whole image and keeps its own bytes.
+    UploadWide {
+        /// PicoROM serving the bytes at even offsets in the image.
+        even: String,
+        /// PicoROM serving the bytes at odd offsets in the image.
+        odd: String,
+        /// Path of file to upload.
+        source: PathBuf,
+        /// Size of each of the two emulated ROMs.
+        #[arg(value_enum, ignore_case=true, default_value_t=RomSize::MBit(2))]
+        size: RomSize,
+        /// Store the uploaded images in flash memory also.
+        #[arg(short, long, default_value_t = false)]
+        store: bool,
+    },
+
+    /// Check a PicoROM holds a ROM image
+    Verify {
+        /// PicoROM device name.
+        name: String,
+        /// Path of file to compare against.
+        source: PathBuf,
+        /// Size of the emulated ROM.
+        #[arg(value_enum, ignore_case=true, default_value_t=RomSize::MBit(2))]
+        size: RomSize,
+        /// Check the image stored in flash memory instead.
+        #[arg(short, long, default_value_t = false)]
+        flash: bool,
+    },
+
+    /// Save the ROM image from a PicoROM to a file
+    Download {
+        /// PicoROM device name.
+        name: String,
+        /// Path of file to write.
+        dest: PathBuf,
+        /// Size of the emulated ROM.
+        #[arg(value_enum, ignore_case=true, default_value_t=RomSize::MBit(2))]
+        size: RomSize,
     },
 }
 
@@ -83,10 +285,10 @@ fn main() -> Result<()> {
 
     match args.command {
         Commands::List => {
-            let found = enumerate_picos()?;
+            let found = enumerate_names()?;
             if found.len() > 0 {
                 println!("Available PicoROMs:");
-                for k in found.keys() {
+                for k in found.iter() {
                     println!("  {}", k);
                 }
             } else {
@@ -98,7 +300,7 @@ fn main() -> Result<()> {
             pico.identify()?;
             println!("Requested identification from '{}'", name);
         }
-        Commands::Commit { name } => {
+        Commands::Commit { name, slot } => {
             let mut pico = find_pico(&name)?;
             let spinner = ProgressBar::new_spinner()
                 .with_prefix("Storing to Flash")
@@ -108,9 +310,170 @@ fn main() -> Result<()> {
                         .tick_chars(r"\|/--"),
                 );
             spinner.enable_steady_tick(Duration::from_millis(250));
-            pico.commit_rom()?;
+            pico.commit_slot(slot)?;
             spinner.finish_with_message("Done.");
         }
+        Commands::Load { name, slot, boot } => {
+            let mut pico = find_pico(&name)?;
+            pico.load_slot(slot, boot)?;
+            println!("Loaded slot {} on '{}'", slot, name);
+        }
+        Commands::Latency { name, samples } => {
+            let mut pico = find_pico(&name)?;
+            let report = pico.latency_test(samples)?;
+            println!("System clock {} kHz", report.sys_khz);
+            for (label, stats) in [("Address to data", report.addr), ("OE to data", report.oe)] {
+                println!(
+                    "  {:16} min {:5.1}ns  avg {:5.1}ns  max {:5.1}ns  ({} timeouts)",
+                    label,
+                    report.ns(stats.min),
+                    report.ns(stats.avg),
+                    report.ns(stats.max),
+                    stats.timeouts
+                );
+            }
+        }
+        Commands::Ping { name, count } => {
+            let mut pico = find_pico(&name)?;
+            let mut times = Vec::new();
+            for _ in 0..count.max(1) {
+                let start = Instant::now();
+                pico.get_ident()?;
+                times.push(start.elapsed());
+            }
+            let total: Duration = times.iter().sum();
+            println!(
+                "min {:?} avg {:?} max {:?}",
+                times.iter().min().unwrap(),
+                total / times.len() as u32,
+                times.iter().max().unwrap()
+            );
+        }
+        Commands::Trace { name, start } => {
+            let mut pico = find_pico(&name)?;
+            if start {
+                pico.trace_start()?;
+                println!("Tracing '{}'", name);
+            } else {
+                let (total, runs) = pico.trace_read()?;
+                for run in runs.iter() {
+                    if run.len > 1 {
+                        println!("{:05x}-{:05x}", run.addr, run.addr + run.len - 1);
+                    } else {
+                        println!("{:05x}", run.addr);
+                    }
+                }
+                println!("{} accesses, {} runs shown", total, runs.len());
+            }
+        }
+        Commands::Coverage { name, start, clear } => {
+            let mut pico = find_pico(&name)?;
+            if start {
+                pico.coverage_start()?;
+                println!("Recording coverage for '{}'", name);
+            } else {
+                let map = pico.coverage_read(clear)?;
+                let mut covered = 0;
+                let mut block = 0;
+                while block < map.len() {
+                    if !map[block] {
+                        block += 1;
+                        continue;
+                    }
+                    let first = block;
+                    while block < map.len() && map[block] {
+                        block += 1;
+                    }
+                    covered += block - first;
+                    println!(
+                        "{:05x}-{:05x}",
+                        first as u32 * COVERAGE_BLOCK_SIZE,
+                        block as u32 * COVERAGE_BLOCK_SIZE - 1
+                    );
+                }
+                println!(
+                    "{} of {} blocks of {} bytes covered",
+                    covered,
+                    map.len(),
+                    COVERAGE_BLOCK_SIZE
+                );
+            }
+        }
+        Commands::Watch { name, addrs } => {
+            let mut pico = find_pico(&name)?;
+            for (index, addr) in addrs.iter().enumerate() {
+                pico.set_trigger(
+                    index as u8,
+                    Some(Trigger {
+                        addr: *addr,
+                        substitute: None,
+                    }),
+                )?;
+            }
+            println!("Watching {} address(es) on '{}'", addrs.len(), name);
+
+            loop {
+                if let Some(hit) = pico.wait_trigger(Duration::from_secs(1))? {
+                    println!(
+                        "{:05x} hit {} at {}us",
+                        addrs[hit.index as usize], hit.count, hit.time_us
+                    );
+                }
+            }
+        }
+        Commands::Clock { name, profile } => {
+            let mut pico = find_pico(&name)?;
+            if let Some(profile) = profile {
+                pico.set_clock(profile.profile())?;
+            }
+            let (profile, khz) = pico.get_clock()?;
+            println!("'{}' clock profile {:?}, {} kHz", name, profile, khz);
+        }
+        Commands::BootTime { name } => {
+            let mut pico = find_pico(&name)?;
+            let (serving, loaded) = pico.boot_time()?;
+            println!(
+                "'{}' serving after {}us, image loaded after {}us",
+                name, serving, loaded
+            );
+        }
+        Commands::Stats { name, interval } => {
+            let mut pico = find_pico(&name)?;
+            let first = pico.get_stats()?;
+
+            let rows = |s: &Stats| {
+                [
+                    ("Packets", s.packets),
+                    ("Bulk bytes", s.bulk_bytes),
+                    ("USB write retries", s.usb_write_retries),
+                    ("Comms bytes out", s.comms_out_bytes),
+                    ("Comms bytes in", s.comms_in_bytes),
+                    ("Comms out stalls", s.comms_out_stalls),
+                    ("Comms timeouts", s.comms_timeouts),
+                    ("ROM active polls", s.rom_active_polls),
+                ]
+            };
+
+            if let Some(interval) = interval {
+                std::thread::sleep(Duration::from_secs_f32(interval));
+                let second = pico.get_stats()?;
+                let secs = second.uptime_ms.wrapping_sub(first.uptime_ms) as f32 / 1000.0;
+
+                println!("'{}' over {:.2}s", name, secs);
+                for ((label, a), (_, b)) in rows(&first).iter().zip(rows(&second).iter()) {
+                    println!(
+                        "  {:18} {:>12.1}/s",
+                        label,
+                        b.wrapping_sub(*a) as f32 / secs
+                    );
+                }
+            } else {
+                println!("'{}' up {:.1}s", name, first.uptime_ms as f32 / 1000.0);
+                for (label, value) in rows(&first) {
+                    println!("  {:18} {:>12}", label, value);
+                }
+            }
+        }
         Commands::Rename { current, new } => {
             let mut pico = find_pico(&current)?;
             pico.set_ident(&new)?;
@@ -121,6 +484,8 @@ fn main() -> Result<()> {
             source,
             size,
             store,
+            delta,
+            swap,
         } => {
             let mut pico = find_pico(&name)?;
             let data = read_file(source.as_path(), size)?;
@@ -131,7 +496,15 @@ fn main() -> Result<()> {
                         .unwrap()
                         .progress_chars("#>-"),
                 );
-            pico.upload(&data, size.mask(), |x| progress.inc(x as u64))?;
+            if swap {
+                let len = data.len().min(IMAGE_SLOT_SIZE);
+                progress.set_length(len as u64);
+                pico.upload_swap(&data[..len], size.mask(), |x| progress.inc(x as u64))?;
+            } else if delta {
+                pico.upload_delta(&data, size.mask(), |x| progress.inc(x as u64))?;
+            } else {
+                pico.upload(&data, size.mask(), |x| progress.inc(x as u64))?;
+            }
             progress.finish_with_message("Done.");
             if store {
                 let spinner = ProgressBar::new_spinner()
@@ -146,6 +519,137 @@ fn main() -> Result<()> {
                 spinner.finish_with_message("Done.");
             }
         }
+        Commands::UploadAll {
+            source,
+            size,
+            store,
+            names,
+        } => {
+            let data = read_file(source.as_path(), size)?;
+
+            let mut picos: Vec<(String, PicoLink)> = enumerate_picos()?
+                .into_iter()
+                .filter(|(name, _)| names.is_empty() || names.contains(name))
+                .collect();
+            for name in &names {
+                if !picos.iter().any(|(x, _)| x == name) {
+                    return Err(anyhow!("PicoROM '{}' not found.", name));
+                }
+            }
+            if picos.is_empty() {
+                return Err(anyhow!("No PicoROMs found."));
+            }
+            picos.sort_by(|a, b| a.0.cmp(&b.0));
+
+            let bars = MultiProgress::new();
+            let style =
+                ProgressStyle::with_template("{prefix:.bold} [{wide_bar:.cyan/blue}] {msg:10}")
+                    .unwrap()
+                    .progress_chars("#>-");
+
+            // One thread per device, each uploads, verifies and stores on its own
+            let results: Vec<(String, Result<Duration>)> = std::thread::scope(|s| {
+                let handles: Vec<_> = picos
+                    .into_iter()
+                    .map(|(name, mut pico)| {
+                        let progress = bars.add(
+                            ProgressBar::new(data.len() as u64)
+                                .with_prefix(format!("Uploading to '{}'", name))
+                                .with_style(style.clone()),
+                        );
+                        let data = &data;
+                        s.spawn(move || {
+                            let start = Instant::now();
+                            let res = pico
+                                .upload(data, size.mask(), |x| progress.inc(x as u64))
+                                .map(|_| start.elapsed())
+                                .and_then(|elapsed| {
+                                    if store {
+                                        progress.set_message("Storing");
+                                        pico.commit_rom()?;
+                                    }
+                                    Ok(elapsed)
+                                });
+                            progress.finish_with_message(if res.is_ok() {
+                                "Done."
+                            } else {
+                                "Failed."
+                            });
+                            (name, res)
+                        })
+                    })
+                    .collect();
+
+                handles.into_iter().map(|h| h.join().unwrap()).collect()
+            });
+
+            let mut failed = 0;
+            for (name, res) in &results {
+                match res {
+                    Ok(elapsed) => println!(
+                        "'{}' verified, uploaded in {:.2}s ({:.0} KB/s)",
+                        name,
+                        elapsed.as_secs_f32(),
+                        data.len() as f32 / 1024.0 / elapsed.as_secs_f32()
+                    ),
+                    Err(e) => {
+                        println!("'{}' failed: {}", name, e);
+                        failed += 1;
+                    }
+                }
+            }
+            if failed > 0 {
+                return Err(anyhow!("{} of {} uploads failed", failed, results.len()));
+            }
+        }
+        Commands::UploadWide {
+            even,
+            odd,
+            source,
+            size,
+            store,
+        } => {
+            let data = read_wide_file(source.as_path(), size)?;
+            for (name, lane) in [(even, ByteLane::Even), (odd, ByteLane::Odd)] {
+                let mut pico = find_pico(&name)?;
+                let progress = ProgressBar::new(data.len() as u64)
+                    .with_prefix(format!("Uploading {:?} bytes to '{}'", lane, name))
+                    .with_style(
+                        ProgressStyle::with_template(
+                            "{prefix:.bold} [{wide_bar:.cyan/blue}] {msg:10}",
+                        )
+                        .unwrap()
+                        .progress_chars("#>-"),
+                    );
+                pico.upload_lane(&data, lane, size.mask(), |x| progress.inc(x as u64))?;
+                progress.finish_with_message("Done.");
+                if store {
+                    pico.commit_rom()?;
+                }
+            }
+        }
+        Commands::Verify {
+            name,
+            source,
+            size,
+            flash,
+        } => {
+            let mut pico = find_pico(&name)?;
+            let data = read_file(source.as_path(), size)?;
+            let memory = if flash {
+                ChecksumSource::Flash
+            } else {
+                ChecksumSource::Ram
+            };
+            pico.verify(0, &data, memory)?;
+            println!("'{}' matches {:?}", name, source);
+        }
+        Commands::Download { name, dest, size } => {
+            let mut pico = find_pico(&name)?;
+            let data = pico.read(0, size.bytes() as u32)?;
+            fs::write(dest.as_path(), data)?;
+            println!("Saved '{}' to {:?}", name, dest);
+        }
     }
 
     Ok(())
@@ -1,4 +1,3 @@
-use std::thread::sleep;
 use std::time::{Duration, Instant};
 
 use picolink::*;
@@ -20,6 +19,9 @@ create_exception!(
     "Communication timeout"
 );
 
+/// How long a blocking read waits before checking for Python signals
+const SIGNAL_CHECK_INTERVAL: Duration = Duration::from_millis(50);
+
 /// A PicoROM connection.
 #[pyclass]
 struct PicoROM {
@@ -67,6 +69,80 @@ impl PicoROM {
         Ok(self.link.commit_rom()?)
     }
 
+    /// Commit the current ROM data to a flash slot
+    fn commit_slot(&mut self, slot: u8) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        Ok(self.link.commit_slot(slot)?)
+    }
+
+    /// Replace the ROM data with a flash slot, optionally loading it at startup too
+    #[pyo3(signature = (slot, boot=false), text_signature = "(slot, boot=False, /)")]
+    fn load_slot(&mut self, slot: u8, boot: bool) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        Ok(self.link.load_slot(slot, boot)?)
+    }
+
+    /// Start recording the addresses the target accesses
+    fn trace_start(&mut self) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        Ok(self.link.trace_start()?)
+    }
+
+    /// Stop tracing and return a list of (address, length) runs of sequential accesses
+    fn trace_read(&mut self) -> PyResult<Vec<(u32, u32)>> {
+        self.comms_inactive()?;
+
+        let (_, runs) = self.link.trace_read()?;
+        Ok(runs.iter().map(|x| (x.addr, x.len)).collect())
+    }
+
+    /// Start recording which 64 byte blocks the target reads from
+    fn coverage_start(&mut self) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        Ok(self.link.coverage_start()?)
+    }
+
+    /// Return a list with a bool per block, True if it has been read
+    #[pyo3(signature = (clear=false), text_signature = "(clear=False, /)")]
+    fn coverage_read(&mut self, clear: bool) -> PyResult<Vec<bool>> {
+        self.comms_inactive()?;
+
+        Ok(self.link.coverage_read(clear)?)
+    }
+
+    /// Fire a trigger on every read of addr, optionally writing substitute_value to
+    /// substitute_addr each time. Passing no addr disables the trigger.
+    #[pyo3(
+        signature = (index, addr=None, substitute_addr=None, substitute_value=0),
+        text_signature = "(index, addr=None, substitute_addr=None, substitute_value=0, /)"
+    )]
+    fn set_trigger(
+        &mut self,
+        index: u8,
+        addr: Option<u32>,
+        substitute_addr: Option<u32>,
+        substitute_value: u8,
+    ) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        let trigger = addr.map(|addr| Trigger {
+            addr,
+            substitute: substitute_addr.map(|x| (x, substitute_value)),
+        });
+        Ok(self.link.set_trigger(index, trigger)?)
+    }
+
+    /// Wait for a trigger hit, returning (index, time_us, count) or None on timeout
+    #[pyo3(signature = (timeout=1.0), text_signature = "(timeout=1.0, /)")]
+    fn wait_trigger(&mut self, timeout: f32) -> PyResult<Option<(u8, u32, u32)>> {
+        let hit = self.link.wait_trigger(Duration::from_secs_f32(timeout))?;
+        Ok(hit.map(|x| (x.index, x.time_us, x.count)))
+    }
+
     /// Ask PicoROM to identify itself
     fn identify(&mut self) -> PyResult<()> {
         self.comms_inactive()?;
@@ -74,12 +150,42 @@ impl PicoROM {
         Ok(self.link.identify()?)
     }
 
-    /// Upload ROM data
-    #[pyo3(signature = (data, mask=0x3ffff), text_signature = "(data, mask=0x3ffff, /)")]
-    fn upload(&mut self, data: &[u8], mask: u32) -> PyResult<()> {
+    /// Upload ROM data, if delta is set only the changed parts are sent
+    #[pyo3(
+        signature = (data, mask=0x3ffff, delta=false),
+        text_signature = "(data, mask=0x3ffff, delta=False, /)"
+    )]
+    fn upload(&mut self, data: &[u8], mask: u32, delta: bool) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        if delta {
+            self.link.upload_delta(data, mask, |_| {})?;
+        } else {
+            self.link.upload(data, mask, |_| {})?;
+        }
+
+        Ok(())
+    }
+
+    /// Upload ROM data while the current image keeps being served, then
+    /// switch to it. Only for images up to 128KB.
+    #[pyo3(signature = (data, mask=0x1ffff), text_signature = "(data, mask=0x1ffff, /)")]
+    fn upload_swap(&mut self, data: &[u8], mask: u32) -> PyResult<()> {
+        self.comms_inactive()?;
+
+        self.link.upload_swap(data, mask, |_| {})?;
+
+        Ok(())
+    }
+
+    /// Upload the even (odd=False) or odd bytes of an interleaved 16-bit image,
+    /// for one of a pair of PicoROMs emulating a 16-bit ROM
+    #[pyo3(signature = (data, odd, mask=0x3ffff), text_signature = "(data, odd, mask=0x3ffff, /)")]
+    fn upload_lane(&mut self, data: &[u8], odd: bool, mask: u32) -> PyResult<()> {
         self.comms_inactive()?;
 
-        self.link.upload(data, mask, |_| {})?;
+        let lane = if odd { ByteLane::Odd } else { ByteLane::Even };
+        self.link.upload_lane(data, lane, mask, |_| {})?;
 
         Ok(())
     }
@@ -93,11 +199,13 @@ impl PicoROM {
         Ok(())
     }
 
-    /// Start two-way communications
-    fn start_comms(&mut self, addr: u32) -> PyResult<()> {
+    /// Start two-way communications, block mode trades the per byte handshake
+    /// for rings the target polls
+    #[pyo3(signature = (addr, block=false), text_signature = "(addr, block=False, /)")]
+    fn start_comms(&mut self, addr: u32, block: bool) -> PyResult<()> {
         self.comms_inactive()?;
 
-        self.link.send(ReqPacket::CommsStart(addr))?;
+        self.link.comms_start(addr, block)?;
         self.comms_active = true;
         self.read_buffer.clear();
         Ok(())
@@ -107,7 +215,7 @@ impl PicoROM {
     fn end_comms(&mut self) -> PyResult<()> {
         self.comms_active()?;
 
-        self.link.send(ReqPacket::CommsEnd)?;
+        self.link.comms_end()?;
         self.comms_active = false;
         self.read_buffer.clear();
         Ok(())
@@ -146,7 +254,12 @@ impl PicoROM {
         let end = timeout.map(|x| Instant::now() + Duration::from_secs_f32(x));
 
         loop {
-            let new_data = self.link.poll_comms(None)?;
+            // Blocks until data arrives, waking now and again for Ctrl-C
+            let mut wait = SIGNAL_CHECK_INTERVAL;
+            if let Some(end) = end {
+                wait = wait.min(end.saturating_duration_since(Instant::now()));
+            }
+            let new_data = self.link.wait_comms(wait)?;
             self.read_buffer.extend_from_slice(&new_data);
 
             if self.read_buffer.len() < size {
@@ -156,7 +269,6 @@ impl PicoROM {
                     }
                 }
                 py.check_signals()?;
-                sleep(Duration::from_micros(10));
             } else {
                 return Ok(self.read_buffer.drain(0..size).collect());
             }
@@ -177,14 +289,18 @@ impl PicoROM {
 /// Enumerate all available PicoROMs
 #[pyfunction]
 fn enumerate() -> PyResult<Vec<String>> {
-    let picos = enumerate_picos()?;
-    Ok(Vec::from_iter(picos.keys().cloned()))
+    Ok(enumerate_names()?)
 }
 
-/// Open a connection to the named PicoROM.
+/// Open a connection to the named PicoROM. With reader set incoming data is
+/// drained continuously by a background thread.
 #[pyfunction]
-fn open(name: &str) -> PyResult<PicoROM> {
-    let pico = find_pico(name)?;
+#[pyo3(signature = (name, reader=false), text_signature = "(name, reader=False, /)")]
+fn open(name: &str, reader: bool) -> PyResult<PicoROM> {
+    let mut pico = find_pico(name)?;
+    if reader {
+        pico.start_reader()?;
+    }
     Ok(PicoROM {
         link: pico,
         read_buffer: Vec::new(),